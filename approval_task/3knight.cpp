@@ -1,19 +1,43 @@
 #include <iostream>
 #include <vector>
 #include <string>
+#include <string_view>
 #include <cstring>
 #include <filesystem>
-#include <sstream>
+#include <fstream>
+#include <charconv>
 #include <chrono>
+#include <ctime>
+#include <cerrno>
 #include <type_traits>
+#include <array>
+#include <deque>
+#include <memory>
+#include <unordered_map>
+#include <unordered_set>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <queue>
+#include <algorithm>
 
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/resource.h>
+#include <fcntl.h>
+#include <dirent.h>
 #include <unistd.h>
 #include <pwd.h>
 #include <grp.h>
 
+// Build with -DDEBUG=1 to get statistics of caches on stderr
+#ifndef DEBUG
+#define DEBUG 0
+#endif
+
 namespace fs = std::filesystem;
 
 /**
@@ -40,19 +64,42 @@ std::vector<std::string> parse_args(int argc, char **argv) {
 /**
  * ls-specific data info
  * Could show only one directory. Directory, not file.
+ * -R lists its subdirectories too, see tree_lister
+ * -C file keeps directory sizes of -l in the file, see size_cache
+ * Entries are sorted by name, -t sorts them by mtime (newest first), -S by size
+ * (largest first), -U leaves them in the directory order, and -r reverses
+ * the order. The last of -t -S -U wins, see sort_entries()
  */
+enum class sort_by { name, mtime, size, none };
+
 struct lsdata {
-    bool l_flag;
-    bool a_flag;
+    bool l_flag {};
+    bool a_flag {};
+    bool R_flag {};
+    bool r_flag {};
+    sort_by sort { sort_by::name };
     std::string dirname {'.'};
+    std::string cachefile;
     
     static lsdata fromRawArgs(const std::vector<std::string>& args) {
         lsdata data;
-        for (int i = 1; i < args.size(); ++i) {
+        for (std::size_t i = 1; i < args.size(); ++i) {
             if (args[i] == "l") {
                 data.l_flag = true;
             } else if (args[i] == "a") {
                 data.a_flag = true;
+            } else if (args[i] == "R") {
+                data.R_flag = true;
+            } else if (args[i] == "r") {
+                data.r_flag = true;
+            } else if (args[i] == "t") {
+                data.sort = sort_by::mtime;
+            } else if (args[i] == "S") {
+                data.sort = sort_by::size;
+            } else if (args[i] == "U") {
+                data.sort = sort_by::none;
+            } else if (args[i] == "C" && i + 1 < args.size()) {
+                data.cachefile = args[++i];
             } else {
                 data.dirname = args[i];
             }
@@ -62,105 +109,1181 @@ struct lsdata {
     }
 };
 
-std::string permissions(const fs::path& file) {
-    auto status = fs::status(file);
-    std::ostringstream s;
-    auto perms = status.permissions();
-
-    if (fs::is_regular_file(status)) s << '-';
-    else if (fs::is_directory(status)) s << 'd';
-    else if (fs::is_block_file(status)) s << 'b';
-    else if (fs::is_character_file(status)) s << 'c';
-    else if (fs::is_fifo(status)) s << 'p';
-    else if (fs::is_socket(status)) s << 's';
-    else if (fs::is_symlink(status)) s << 'l';
-
-    s << ((perms & fs::perms::owner_read) != fs::perms::none ? "r" : "-")
-      << ((perms & fs::perms::owner_write) != fs::perms::none ? "w" : "-")
-      << ((perms & fs::perms::owner_exec) != fs::perms::none ? "x" : "-")
-      << ((perms & fs::perms::group_read) != fs::perms::none ? "r" : "-")
-      << ((perms & fs::perms::group_write) != fs::perms::none ? "w" : "-")
-      << ((perms & fs::perms::group_exec) != fs::perms::none ? "x" : "-")
-      << ((perms & fs::perms::others_read) != fs::perms::none ? "r" : "-")
-      << ((perms & fs::perms::others_write) != fs::perms::none ? "w" : "-")
-      << ((perms & fs::perms::others_exec) != fs::perms::none ? "x" : "-");
- 
-    return s.str();
+/**
+ * Everything -l shows about an entry comes from a single statx() relative to
+ * the directory fd: the path is not resolved again for every field, and only
+ * the fields we print are requested.
+ * Symlinks are followed, a dangling one is shown as the link itself
+ */
+constexpr unsigned STATX_LISTING = STATX_TYPE | STATX_MODE | STATX_NLINK | STATX_UID
+                                 | STATX_GID | STATX_SIZE | STATX_MTIME;
+
+bool stat_entry(int dirfd, const char *name, struct statx& stx) {
+    if (statx(dirfd, name, 0, STATX_LISTING, &stx) == 0) return true;
+    return statx(dirfd, name, AT_SYMLINK_NOFOLLOW, STATX_LISTING, &stx) == 0;
 }
 
-struct unix_only_stats { 
-    using tstring = decltype(std::put_time((struct tm*) nullptr, (char*)nullptr));
+bool is_dot_or_dotdot(const char *name) {
+    return name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'));
+}
+
+/**
+ * Output is rendered into a large buffer which is handed to write() when it
+ * is full, so a listing of a million entries takes a few hundred syscalls and
+ * no allocations. Nothing here is locale dependent, same as the "C" locale
+ * std::cout had.
+ * Without fd the buffer grows instead and keeps everything, see text()
+ */
+class out_buffer {
+public:
+    explicit out_buffer(int fd = -1) : fd { fd }, buf(fd >= 0 ? SIZE : 0) { }
+    out_buffer(const out_buffer&) = delete;
+    ~out_buffer() { flush(); }
+
+    // room for n more chars, to be filled and then commit()ed
+    char *reserve(std::size_t n) {
+        if (len + n > buf.size()) {
+            if (fd >= 0) flush();
+            if (len + n > buf.size()) buf.resize(std::max(2 * buf.size(), len + n));
+        }
+        return buf.data() + len;
+    }
+
+    std::string_view text() const { return { buf.data(), len }; }
+
+    void commit(std::size_t n) { len += n; }
+
+    out_buffer& put(char c) {
+        *reserve(1) = c;
+        commit(1);
+        return *this;
+    }
+
+    out_buffer& put(std::string_view sv) {
+        if (fd >= 0 && sv.size() > SIZE) {
+            flush();
+            write_all(sv.data(), sv.size());
+            return *this;
+        }
+        std::memcpy(reserve(sv.size()), sv.data(), sv.size());
+        commit(sv.size());
+        return *this;
+    }
+
+    out_buffer& put(std::uint64_t value) {
+        constexpr std::size_t DIGITS = 20;
+        char *p = reserve(DIGITS);
+        commit(std::to_chars(p, p + DIGITS, value).ptr - p);
+        return *this;
+    }
+
+    // false if anything has failed to be written
+    bool flush() {
+        if (fd < 0) return true;
+        write_all(buf.data(), len);
+        len = 0;
+        return !failed;
+    }
 
-    tstring time;
-    std::string owner, group;
+private:
+    static constexpr std::size_t SIZE = 1 << 20;
 
-    unix_only_stats(tstring time, std::string owner, std::string group)
-        : time { time }, owner { owner }, group { group } { }
+    int fd;
+    std::vector<char> buf;
+    std::size_t len {};
+    bool failed {};
 
-    unix_only_stats() = default;
+    void write_all(const char *data, std::size_t n) {
+        while (n > 0 && !failed) {
+            ssize_t written = write(fd, data, n);
+            if (written < 0 && errno == EINTR) continue;
+            if (written < 0) {
+                failed = true;
+                break;
+            }
+            data += written;
+            n -= written;
+        }
+    }
 };
 
-unix_only_stats get_fstat(const fs::path& file) {
+/**
+ * ls style mode string like drwxr-xr-x, by table lookups
+ */
+constexpr std::size_t PERMS_LEN = 10;
+
+void permissions(mode_t mode, char *out) {
+    static constexpr char RWX[8][3] = {
+        { '-', '-', '-' }, { '-', '-', 'x' }, { '-', 'w', '-' }, { '-', 'w', 'x' },
+        { 'r', '-', '-' }, { 'r', '-', 'x' }, { 'r', 'w', '-' }, { 'r', 'w', 'x' },
+    };
+
+    switch (mode & S_IFMT) {
+    case S_IFDIR: out[0] = 'd'; break;
+    case S_IFBLK: out[0] = 'b'; break;
+    case S_IFCHR: out[0] = 'c'; break;
+    case S_IFIFO: out[0] = 'p'; break;
+    case S_IFSOCK: out[0] = 's'; break;
+    case S_IFLNK: out[0] = 'l'; break;
+    default: out[0] = '-';
+    }
+    std::memcpy(out + 1, RWX[(mode >> 6) & 7], 3);
+    std::memcpy(out + 4, RWX[(mode >> 3) & 7], 3);
+    std::memcpy(out + 7, RWX[mode & 7], 3);
+}
+
+/**
+ * mtime as "%b %d %H:%M" in local time.
+ * localtime() takes a lock and checks whether TZ has changed on every call.
+ * But the UTC offset only changes at DST and zone switches, which (save for
+ * a few before 1980) happen on quarters of an hour, so it is asked for once
+ * per such quarter (in a small direct mapped table) and the date is then
+ * computed from days since the epoch
+ */
+constexpr std::size_t TIME_LEN = 12;
+
+class time_cache {
+public:
+    void format(std::time_t t, char *out) {
+        std::int64_t local = t + offset(t);
+        std::int64_t days = floor_div(local, 86400);
+        std::int64_t secs = local - days * 86400;
+        auto [month, day] = month_day(days);
+
+        static constexpr char MONTHS[12][3] = {
+            { 'J', 'a', 'n' }, { 'F', 'e', 'b' }, { 'M', 'a', 'r' }, { 'A', 'p', 'r' },
+            { 'M', 'a', 'y' }, { 'J', 'u', 'n' }, { 'J', 'u', 'l' }, { 'A', 'u', 'g' },
+            { 'S', 'e', 'p' }, { 'O', 'c', 't' }, { 'N', 'o', 'v' }, { 'D', 'e', 'c' },
+        };
+        std::memcpy(out, MONTHS[month - 1], 3);
+        out[3] = ' ';
+        two_digits(day, out + 4);
+        out[6] = ' ';
+        two_digits(secs / 3600, out + 7);
+        out[9] = ':';
+        two_digits(secs / 60 % 60, out + 10);
+    }
+
+private:
+    struct slot {
+        std::int64_t quarter = INT64_MIN;
+        long gmtoff;
+    };
+
+    std::array<slot, 256> slots;
+
+    static std::int64_t floor_div(std::int64_t a, std::int64_t b) {
+        return a / b - (a % b < 0);
+    }
+
+    static void two_digits(unsigned value, char *out) {
+        out[0] = '0' + value / 10;
+        out[1] = '0' + value % 10;
+    }
+
+    long offset(std::time_t t) {
+        std::int64_t quarter = floor_div(t, 900);
+        auto& s = slots[quarter & (slots.size() - 1)];
+        if (s.quarter != quarter) {
+            struct tm tm;
+            s.quarter = quarter;
+            s.gmtoff = localtime_r(&t, &tm) != nullptr ? tm.tm_gmtoff : 0;
+        }
+        return s.gmtoff;
+    }
+
+    // proleptic Gregorian calendar, see howardhinnant.github.io/date_algorithms.html
+    static std::pair<unsigned, unsigned> month_day(std::int64_t days) {
+        days += 719468;
+        std::int64_t era = floor_div(days, 146097);
+        unsigned doe = days - era * 146097;
+        unsigned yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+        unsigned doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+        unsigned mp = (5 * doy + 2) / 153;
+        return { mp < 10 ? mp + 3 : mp - 9, doy - (153 * mp + 2) / 5 + 1 };
+    }
+};
+
+/**
+ * Owner and group names by id. Every getpwuid()/getgrgid() goes through NSS
+ * (reads /etc/passwd, or asks nscd or LDAP), while a directory usually has
+ * a handful of owners, so each id is looked up once per listing.
+ * An id with no name is shown as the number, the same as ls does.
+ * The reentrant versions are used, since -R has a cache per thread
+ */
+class name_cache {
+public:
+    std::string_view user(uid_t uid) {
+        return lookup(users, uid, [this](uid_t id) {
+            struct passwd pw, *found = nullptr;
+            while (getpwuid_r(id, &pw, buf.data(), buf.size(), &found) == ERANGE)
+                buf.resize(2 * buf.size());
+            return found != nullptr ? std::string { pw.pw_name } : std::to_string(id);
+        });
+    }
+
+    std::string_view group(gid_t gid) {
+        return lookup(groups, gid, [this](gid_t id) {
+            struct group gr, *found = nullptr;
+            while (getgrgid_r(id, &gr, buf.data(), buf.size(), &found) == ERANGE)
+                buf.resize(2 * buf.size());
+            return found != nullptr ? std::string { gr.gr_name } : std::to_string(id);
+        });
+    }
+
+    void report(std::ostream& out) const {
+        out << "Name cache hits " << hits << " misses " << misses << '\n';
+    }
+
+private:
+    // node based, so the names do not move when the map grows
+    std::unordered_map<unsigned, std::string> users, groups;
+    std::size_t hits {}, misses {};
+    std::vector<char> buf = std::vector<char>(1024);    // for the *_r lookups
+
+    template <typename Resolve>
+    std::string_view lookup(std::unordered_map<unsigned, std::string>& names, unsigned id,
+                            Resolve resolve) {
+        auto it = names.find(id);
+        if (it != names.end()) {
+            ++hits;
+            return it->second;
+        }
+        ++misses;
+        return names.emplace(id, resolve(id)).first->second;
+    }
+};
+
+struct unix_only_stats { 
+    std::string_view owner, group;
+};
+
+unix_only_stats get_fstat(uid_t uid, gid_t gid, name_cache& names) {
     // this part is not crossplatform, because c++ haven't standardized it yet,
     // to be added in c++20 
-    struct stat stat_buf;
-    stat(file.string().c_str(), &stat_buf);
+    return unix_only_stats {
+        names.user(uid),
+        names.group(gid)
+    };
+}
 
-    auto modification_time = std::put_time(std::localtime(&stat_buf.st_mtime), "%b %d %H:%M");
-    
-    auto *pw = getpwuid(stat_buf.st_uid);
-    auto  *gr = getgrgid(stat_buf.st_gid);
+std::uint64_t statx_dev(const struct statx& stx) {
+    return makedev(stx.stx_dev_major, stx.stx_dev_minor);
+}
 
-    if (pw == NULL || gr == NULL) {
-        return {};
+/**
+ * Persistent cache of directory sizes, keyed by device and inode of a directory
+ * and valid while its mtime is the same.
+ * A record does not hold the size of the whole subtree, since a change deep
+ * inside it does not touch mtime of the directory. It holds what readdir() and
+ * stat'ing of every entry gave: total size of plain files, files which may be
+ * seen twice (hard links and symlinks, counted once by the walk) and names of
+ * subdirectories. So an unchanged directory costs a single statx() instead of
+ * reading it and stat'ing all its entries, and the subtree is still checked
+ * directory by directory. A file rewritten in place does not change mtime of
+ * its directory either, its old size is used until the directory changes.
+ *
+ * The file is loaded as a whole, is read only during the walk, and is replaced
+ * by a new one with the fresh records merged in by save().
+ * Records stored during the walk are found too, and with no file at all the
+ * cache only saves walks of the same subtrees over and over again (by -R -l).
+ * Such a cache keeps at most MAX_UNSAVED records, and -R drops the record of a
+ * directory as soon as it is listed, since only walks of its parents need it
+ */
+class size_cache {
+public:
+    struct key {
+        std::uint64_t dev, ino;
+        bool operator==(const key& other) const { return dev == other.dev && ino == other.ino; }
+    };
+
+    struct key_hash {
+        std::size_t operator()(const key& k) const {
+            return std::hash<std::uint64_t> {}(k.ino * 0x9E3779B97F4A7C15ull ^ k.dev);
+        }
+    };
+
+    struct link {
+        std::uint64_t dev, ino, size;
+    };
+
+    struct record {
+        std::int64_t mtime_sec {};
+        std::uint32_t mtime_nsec {};
+        std::uint64_t files_size {};
+        std::vector<link> links;
+        std::vector<std::string> subdirs;
+    };
+
+    size_cache() = default;
+
+    explicit size_cache(std::string path) : path { std::move(path) } {
+        load();
     }
 
-    return unix_only_stats {
-        modification_time, 
-        std::string ( pw->pw_name ),
-        std::string ( gr->gr_name )
+    // shared, since a record may be dropped while a walk is still reading it
+    std::shared_ptr<const record> find(const key& k, const struct statx_timestamp& mtime) {
+        {
+            std::lock_guard lock { updates_mtx };
+            if (auto rec = find_in(updates, k, mtime)) return rec;
+        }
+        return find_in(records, k, mtime);
+    }
+
+    // the first record stays, so that records found by others never change
+    void store(const key& k, record rec) {
+        std::lock_guard lock { updates_mtx };
+        if (path.empty() && updates.size() >= MAX_UNSAVED) return;
+        updates.try_emplace(k, std::make_shared<const record>(std::move(rec)));
+    }
+
+    // records to be saved stay
+    void drop(const key& k) {
+        if (!path.empty()) return;
+        std::lock_guard lock { updates_mtx };
+        updates.erase(k);
+    }
+
+    // 0 or errno of what has failed
+    int save();
+
+private:
+    static constexpr char MAGIC[8] = { 'K', 'N', 'S', 'I', 'Z', 'E', 'S', '1' };
+    static constexpr std::size_t MAX_UNSAVED = 1 << 16;
+
+    using record_map = std::unordered_map<key, std::shared_ptr<const record>, key_hash>;
+
+    std::string path;
+    record_map records;
+    std::mutex updates_mtx;
+    record_map updates;
+
+    void load();
+
+    static std::shared_ptr<const record> find_in(const record_map& map, const key& k,
+                                                 const struct statx_timestamp& mtime) {
+        auto it = map.find(k);
+        if (it == map.end()) return nullptr;
+        if (it->second->mtime_sec != mtime.tv_sec || it->second->mtime_nsec != mtime.tv_nsec)
+            return nullptr;
+        return it->second;
+    }
+};
+
+// Native byte order, the file is meant for this machine only. A missing, foreign,
+// truncated or corrupt file is the same as an empty one: counts are checked
+// against what is left of the file before anything is allocated for them
+void size_cache::load() try {
+    std::ifstream in { path, std::ios::binary | std::ios::ate };
+    if (!in) return;
+    std::uint64_t left = in.tellg();
+    in.seekg(0);
+
+    auto get = [&in, &left](auto& value) {
+        if (left < sizeof value) return false;
+        left -= sizeof value;
+        return static_cast<bool>(in.read(reinterpret_cast<char *>(&value), sizeof value));
     };
+    char magic[sizeof MAGIC];
+    if (!get(magic) || std::memcmp(magic, MAGIC, sizeof MAGIC) != 0) return;
+
+    std::uint64_t count;
+    if (!get(count)) return;
+
+    decltype(records) loaded;
+    for (std::uint64_t i = 0; i < count; ++i) {
+        key k;
+        record rec;
+        std::uint32_t nlinks, nsubdirs;
+        if (!get(k.dev) || !get(k.ino) || !get(rec.mtime_sec) || !get(rec.mtime_nsec) ||
+            !get(rec.files_size) || !get(nlinks) || !get(nsubdirs)) return;
+
+        if (nlinks > left / (3 * sizeof(std::uint64_t))) return;
+        rec.links.resize(nlinks);
+        for (auto& l : rec.links) {
+            if (!get(l.dev) || !get(l.ino) || !get(l.size)) return;
+        }
+        if (nsubdirs > left / sizeof(std::uint16_t)) return;
+        rec.subdirs.resize(nsubdirs);
+        for (auto& name : rec.subdirs) {
+            std::uint16_t len;
+            if (!get(len) || len > left) return;
+            name.resize(len);
+            left -= len;
+            if (!in.read(name.data(), len)) return;
+        }
+        loaded.emplace(k, std::make_shared<const record>(std::move(rec)));
+    }
+    records = std::move(loaded);
+} catch (const std::exception&) {
+    records.clear();
 }
 
-auto get_file_size(const fs::path& file) {
-    if (!fs::is_directory(file)) {
-        return fs::file_size(file);
+// Written to a temporary file which is renamed over the old one, so a listing
+// running at the same time reads either of them whole
+int size_cache::save() {
+    if (path.empty()) return 0;
+    for (auto& [k, rec] : updates) records.insert_or_assign(k, std::move(rec));
+    updates.clear();
+
+    std::string tmp = path + ".tmp" + std::to_string(getpid());
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) return errno;
+
+    int err = 0;
+    {
+        out_buffer out { fd };
+        auto put = [&out](const auto& value) {
+            out.put(std::string_view { reinterpret_cast<const char *>(&value), sizeof value });
+        };
+        put(MAGIC);
+        put(static_cast<std::uint64_t>(records.size()));
+        for (const auto& [k, rec] : records) {
+            put(k.dev);
+            put(k.ino);
+            put(rec->mtime_sec);
+            put(rec->mtime_nsec);
+            put(rec->files_size);
+            put(static_cast<std::uint32_t>(rec->links.size()));
+            put(static_cast<std::uint32_t>(rec->subdirs.size()));
+            for (const auto& l : rec->links) {
+                put(l.dev);
+                put(l.ino);
+                put(l.size);
+            }
+            for (const auto& name : rec->subdirs) {
+                put(static_cast<std::uint16_t>(name.size()));
+                out.put(std::string_view { name });
+            }
+        }
+        if (!out.flush()) err = errno;
+    }
+    if (close(fd) != 0 && err == 0) err = errno;
+    if (err == 0 && rename(tmp.c_str(), path.c_str()) != 0) err = errno;
+
+    if (err != 0) unlink(tmp.c_str());
+    return err;
+}
+
+/**
+ * Open directory shared by everybody who opens entries relative to it
+ */
+struct dir_handle {
+    int fd;
+    DIR *dir;    // owns fd if set
+
+    dir_handle(int fd, DIR *dir) : fd { fd }, dir { dir } { }
+    dir_handle(const dir_handle&) = delete;
+    ~dir_handle() { if (dir != nullptr) closedir(dir); }
+};
+
+class size_walker;
+
+/**
+ * Size walks of a pool of threads which list directories (-R -l). A walk
+ * started there gets no threads of its own: it is posted here, and threads of
+ * the pool which have nothing to list help it. Guarded by the lock of the pool
+ */
+struct walk_board {
+    std::mutex& mtx;
+    std::condition_variable& cv;    // notified when a walk is posted or left
+    unsigned nthreads;              // of the pool
+    std::vector<size_walker *> walks;
+};
+
+/**
+ * Recursive sizes of all directories shown by -l, computed in a single walk by
+ * a pool of threads, its own or the one of a walk_board. Each thread takes
+ * directories from the back of its own deque, so it goes depth first and only
+ * a path worth of directories is open, and an idle thread steals from the
+ * front of another one, which is where the largest untouched subtrees are.
+ * Directories are opened relative to the fd of their parent, which is kept open
+ * until all its subdirectories are. Inodes which may be met twice are counted
+ * once per listed directory: files with several hard links, files reached
+ * through symlinks and directories themselves, so symlink loops end as well
+ */
+class size_walker {
+public:
+    size_walker(size_cache *cache, unsigned nthreads, walk_board *board = nullptr)
+        : cache { cache }, board { board },
+          queues(std::max(board != nullptr ? board->nthreads : nthreads, 1u)) { }
+
+    // Sizes of the directories names[i] relative to dirfd, in the same order
+    std::vector<std::uintmax_t> run(int dirfd, const std::vector<const char *>& names);
+
+    // By a thread of the board's pool, with the lock of the board held: takes
+    // part in the walk until it ends
+    void help(std::unique_lock<std::mutex>& lock);
+
+    bool is_done() const { return pending == 0; }
+
+private:
+    struct task {
+        std::size_t root;
+        std::shared_ptr<dir_handle> parent;
+        std::string name;
+    };
+
+    struct alignas(64) task_queue {
+        std::mutex mtx;
+        std::deque<task> tasks;
+    };
+
+    // who has been counted, sharded so that threads rarely wait for each other
+    struct inode_key {
+        std::size_t root;
+        std::uint64_t dev, ino;
+        bool operator==(const inode_key& other) const {
+            return root == other.root && dev == other.dev && ino == other.ino;
+        }
+    };
+
+    struct inode_hash {
+        std::size_t operator()(const inode_key& k) const {
+            return std::hash<std::uint64_t> {}((k.ino * 0x9E3779B97F4A7C15ull ^ k.dev) + k.root);
+        }
+    };
+
+    struct alignas(64) inode_shard {
+        std::mutex mtx;
+        std::unordered_set<inode_key, inode_hash> keys;
+    };
+
+    static constexpr std::size_t NSHARDS = 64;
+
+    size_cache *cache;
+    walk_board *board;
+    std::size_t nhelpers {};    // under the lock of the board
+    std::vector<task_queue> queues;
+    std::array<inode_shard, NSHARDS> seen;
+    std::unique_ptr<std::atomic<std::uintmax_t>[]> sizes;
+    std::atomic<std::size_t> pending {};
+    std::mutex idle_mtx;
+    std::condition_variable idle_cv;
+
+    bool first_visit(const inode_key& k) {
+        auto& shard = seen[inode_hash {}(k) % NSHARDS];
+        std::lock_guard lock { shard.mtx };
+        return shard.keys.insert(k).second;
+    }
+
+    void push(std::size_t w, task t) {
+        ++pending;
+        {
+            std::lock_guard lock { queues[w].mtx };
+            queues[w].tasks.push_back(std::move(t));
+        }
+        idle_cv.notify_one();
+    }
+
+    bool pop(std::size_t w, task& t);
+    void worker(std::size_t w);
+    void walk(std::size_t w, task t);
+    std::uintmax_t count(std::size_t root, const size_cache::record& rec);
+};
+
+// own tasks first, then anybody's
+bool size_walker::pop(std::size_t w, task& t) {
+    {
+        std::lock_guard lock { queues[w].mtx };
+        if (!queues[w].tasks.empty()) {
+            t = std::move(queues[w].tasks.back());
+            queues[w].tasks.pop_back();
+            return true;
+        }
+    }
+    for (std::size_t i = 1; i < queues.size(); ++i) {
+        auto& victim = queues[(w + i) % queues.size()];
+        std::lock_guard lock { victim.mtx };
+        if (!victim.tasks.empty()) {
+            t = std::move(victim.tasks.front());
+            victim.tasks.pop_front();
+            return true;
+        }
+    }
+    return false;
+}
+
+void size_walker::worker(std::size_t w) {
+    task t;
+    while (pending > 0) {
+        if (pop(w, t)) {
+            walk(w, std::move(t));
+            t = {};
+            // children are pushed before their parent is done, so zero is the end
+            if (--pending == 0) idle_cv.notify_all();
+            continue;
+        }
+        std::unique_lock lock { idle_mtx };
+        idle_cv.wait_for(lock, std::chrono::milliseconds(1));
+    }
+}
+
+std::uintmax_t size_walker::count(std::size_t root, const size_cache::record& rec) {
+    std::uintmax_t size = rec.files_size;
+    for (const auto& l : rec.links) {
+        if (first_visit({ root, l.dev, l.ino })) size += l.size;
+    }
+    return size;
+}
+
+void size_walker::walk(std::size_t w, task t) {
+    int fd = openat(t.parent->fd, t.name.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) return;
+    DIR *dir = fdopendir(fd);
+    if (dir == nullptr) {
+        close(fd);
+        return;
+    }
+    auto self = std::make_shared<dir_handle>(fd, dir);
+    t.parent.reset();
+
+    struct statx stx;
+    if (statx(fd, "", AT_EMPTY_PATH, STATX_INO | STATX_MTIME, &stx) != 0) return;
+    size_cache::key key { statx_dev(stx), stx.stx_ino };
+    if (!first_visit({ t.root, key.dev, key.ino })) return;
+
+    if (cache != nullptr) {
+        if (auto rec = cache->find(key, stx.stx_mtime)) {
+            sizes[t.root] += count(t.root, *rec);
+            for (const auto& name : rec->subdirs) push(w, { t.root, self, name });
+            return;
+        }
+    }
+
+    size_cache::record rec;
+    rec.mtime_sec = stx.stx_mtime.tv_sec;
+    rec.mtime_nsec = stx.stx_mtime.tv_nsec;
+    while (auto *ent = readdir(dir)) {
+        if (is_dot_or_dotdot(ent->d_name)) continue;
+        // no stat for real directories at all
+        if (ent->d_type != DT_DIR) {
+            struct statx est;
+            if (statx(fd, ent->d_name, 0, STATX_TYPE | STATX_NLINK | STATX_INO | STATX_SIZE,
+                      &est) != 0) continue;
+            if (!S_ISDIR(est.stx_mode)) {
+                if (est.stx_nlink > 1 || ent->d_type != DT_REG)
+                    rec.links.push_back({ statx_dev(est), est.stx_ino, est.stx_size });
+                else
+                    rec.files_size += est.stx_size;
+                continue;
+            }
+        }
+        rec.subdirs.emplace_back(ent->d_name);
+        push(w, { t.root, self, ent->d_name });
+    }
+
+    sizes[t.root] += count(t.root, rec);
+    if (cache != nullptr) cache->store(key, std::move(rec));
+}
+
+std::vector<std::uintmax_t> size_walker::run(int dirfd, const std::vector<const char *>& names) {
+    sizes = std::make_unique<std::atomic<std::uintmax_t>[]>(names.size());
+    auto listed = std::make_shared<dir_handle>(dirfd, nullptr);
+    for (std::size_t i = 0; i < names.size(); ++i)
+        push(i % queues.size(), { i, listed, names[i] });
+    listed.reset();
+
+    std::vector<std::thread> threads;
+    if (board != nullptr) {
+        std::lock_guard lock { board->mtx };
+        board->walks.push_back(this);
+        board->cv.notify_all();
     } else {
-        std::uintmax_t size = 0;
-        for (const auto& subfile : fs::directory_iterator { file }) {
-            size += get_file_size(subfile.path().string());
+        for (std::size_t w = 1; w < queues.size() && w < names.size() * 64; ++w)
+            threads.emplace_back(&size_walker::worker, this, w);
+    }
+    worker(0);
+    for (auto& thread : threads) thread.join();
+    if (board != nullptr) {
+        // helpers leave as soon as nothing is pending
+        std::unique_lock lock { board->mtx };
+        board->walks.erase(std::find(board->walks.begin(), board->walks.end(), this));
+        board->cv.wait(lock, [this] { return nhelpers == 0; });
+    }
+
+    std::vector<std::uintmax_t> result(names.size());
+    for (std::size_t i = 0; i < names.size(); ++i) result[i] = sizes[i];
+    return result;
+}
+
+void size_walker::help(std::unique_lock<std::mutex>& lock) {
+    std::size_t w = ++nhelpers % queues.size();
+    lock.unlock();
+    worker(w);
+    lock.lock();
+    --nhelpers;
+    board->cv.notify_all();
+}
+
+DIR *open_dir(int dirfd, const char *name) {
+    int fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) return nullptr;
+
+    DIR *dir = fdopendir(fd);
+    if (dir == nullptr) close(fd);
+    return dir;
+}
+
+/**
+ * What is shown about an entry. Names are kept one after another in a single
+ * array, so a million entries take a couple of allocations
+ */
+struct listing_entry {
+    std::size_t name;    // offset of the NUL terminated name
+    std::uint64_t size;
+    std::int64_t mtime_sec;
+    std::uint32_t mtime_nsec;
+    std::uint32_t mode, nlink, uid, gid;
+    bool is_subdir;      // for -R, not a symlink
+};
+
+/**
+ * What a thread needs to list directories one after another
+ */
+struct listing_state {
+    name_cache names;
+    time_cache times;
+    size_cache *cache;
+    unsigned nthreads;    // of the size walk and the sort, 1 in the -R pool
+    walk_board *board {};    // of the -R pool, which walks sizes then
+};
+
+/**
+ * Sort keys are extracted once into a contiguous array of small structs, and
+ * it is these which are sorted, carrying entry indices along. The key is
+ * turned into an unsigned number ordered the way entries go, and the first
+ * 16 bytes of the name make most of the name comparisons integer ones too,
+ * so names themselves are only looked at for long common prefixes.
+ * Names are compared bytewise, as the "C" locale ls does
+ */
+struct sort_key {
+    std::uint64_t major;
+    std::uint64_t prefix[2];
+    std::uint32_t index;
+};
+
+// big endian, so that integers compare as memcmp() does. The rest is zeros
+// after the end of the name
+void name_prefix(const char *name, std::uint64_t *prefix) {
+    for (int w = 0; w < 2; ++w) {
+        prefix[w] = 0;
+        for (int i = 0; i < 8; ++i) {
+            prefix[w] = prefix[w] << 8 | static_cast<unsigned char>(*name);
+            if (*name != '\0') ++name;
         }
-        return size;
     }
 }
 
-void display(const lsdata& params) {
-    fs::path dir { params.dirname };
-    for (const auto& file : fs::directory_iterator { dir }) {
-        std::string name { fs::proximate(file.path(), dir) };
-     
+/**
+ * std::sort of chunks by threads of their own and then merging of pairs of
+ * sorted runs, again in parallel, until one is left
+ */
+template <typename T, typename Compare>
+void parallel_sort(std::vector<T>& v, Compare less, unsigned nthreads) {
+    constexpr std::size_t MIN_PARALLEL = 1 << 16;
+    std::size_t n = v.size();
+    if (nthreads < 2 || n < MIN_PARALLEL) {
+        std::sort(v.begin(), v.end(), less);
+        return;
+    }
+
+    std::size_t nruns = std::min<std::size_t>(nthreads, n / (MIN_PARALLEL / 2));
+    std::vector<std::size_t> bounds;
+    for (std::size_t i = 0; i <= nruns; ++i) bounds.push_back(n * i / nruns);
+
+    std::vector<std::thread> threads;
+    for (std::size_t i = 0; i < nruns; ++i) {
+        threads.emplace_back([&v, &bounds, &less, i] {
+            std::sort(v.begin() + bounds[i], v.begin() + bounds[i + 1], less);
+        });
+    }
+    for (auto& thread : threads) thread.join();
+
+    std::vector<T> merged(n);
+    while (bounds.size() > 2) {
+        std::vector<std::size_t> next;
+        threads.clear();
+        for (std::size_t i = 0; i + 1 < bounds.size(); i += 2) {
+            next.push_back(bounds[i]);
+            std::size_t first = bounds[i], mid = bounds[i + 1];
+            std::size_t last = i + 2 < bounds.size() ? bounds[i + 2] : mid;
+            threads.emplace_back([&v, &merged, &less, first, mid, last] {
+                std::merge(v.begin() + first, v.begin() + mid, v.begin() + mid,
+                           v.begin() + last, merged.begin() + first, less);
+            });
+        }
+        next.push_back(n);
+        for (auto& thread : threads) thread.join();
+        v.swap(merged);
+        bounds.swap(next);
+    }
+}
+
+// Order in which entries are shown, as indices into entries
+std::vector<std::uint32_t> sort_entries(const std::vector<listing_entry>& entries,
+                                        const std::vector<char>& names,
+                                        const lsdata& params, unsigned nthreads) {
+    std::vector<std::uint32_t> order(entries.size());
+    if (params.sort == sort_by::none) {
+        for (std::size_t i = 0; i < order.size(); ++i) order[i] = i;
+    } else {
+        std::vector<sort_key> keys(entries.size());
+        for (std::size_t i = 0; i < entries.size(); ++i) {
+            const auto& e = entries[i];
+            std::uint64_t major = 0;
+            if (params.sort == sort_by::mtime) {
+                // signed to unsigned keeping the order, then newest first
+                auto ns = static_cast<std::uint64_t>(e.mtime_sec * 1000000000 + e.mtime_nsec);
+                major = ~(ns ^ 1ull << 63);
+            } else if (params.sort == sort_by::size) {
+                major = ~e.size;
+            }
+            keys[i].major = major;
+            name_prefix(&names[e.name], keys[i].prefix);
+            keys[i].index = i;
+        }
+
+        parallel_sort(keys, [&entries, &names](const sort_key& a, const sort_key& b) {
+            if (a.major != b.major) return a.major < b.major;
+            if (a.prefix[0] != b.prefix[0]) return a.prefix[0] < b.prefix[0];
+            if (a.prefix[1] != b.prefix[1]) return a.prefix[1] < b.prefix[1];
+            return std::strcmp(&names[entries[a.index].name], &names[entries[b.index].name]) < 0;
+        }, nthreads);
+        for (std::size_t i = 0; i < keys.size(); ++i) order[i] = keys[i].index;
+    }
+
+    if (params.r_flag) std::reverse(order.begin(), order.end());
+    return order;
+}
+
+/**
+ * Entries are read with readdir() from the directory fd and everything else
+ * is done relative to it. A plain listing sorted by name needs nothing but
+ * the names, so it does not stat anything.
+ * -l gathers all entries first, so that sizes of all directories among them
+ * are computed by a single parallel walk.
+ * Names of subdirectories go to subdirs, in the order they are shown, if it is
+ * given. Symlinks are not followed there, so that -R never loops
+ */
+int list_dir(DIR *dir, const lsdata& params, listing_state& state, out_buffer& out,
+             std::string& errors, std::vector<std::string> *subdirs) {
+    int ret = 0;
+    bool need_stat = params.l_flag || params.sort == sort_by::mtime ||
+                     params.sort == sort_by::size;
+    std::vector<char> names;
+    std::vector<listing_entry> entries;
+    while (auto *ent = readdir(dir)) {
+        const char *name = ent->d_name;
+
+        if (is_dot_or_dotdot(name)) continue;
         if (name[0] == '.' && !params.a_flag) continue;
+
+        listing_entry e {};
+        if (subdirs != nullptr) {
+            struct statx stx;
+            e.is_subdir = ent->d_type == DT_DIR;
+            if (ent->d_type == DT_UNKNOWN &&
+                statx(::dirfd(dir), name, AT_SYMLINK_NOFOLLOW, STATX_TYPE, &stx) == 0)
+                e.is_subdir = S_ISDIR(stx.stx_mode);
+        }
+        if (need_stat) {
+            struct statx stx;
+            if (!stat_entry(::dirfd(dir), name, stx)) {
+                errors.append("Can't access ").append(name).append(": ")
+                      .append(std::strerror(errno)).append("\n");
+                ret = 1;
+                continue;
+            }
+            e.size = stx.stx_size;
+            e.mtime_sec = stx.stx_mtime.tv_sec;
+            e.mtime_nsec = stx.stx_mtime.tv_nsec;
+            e.mode = stx.stx_mode;
+            e.nlink = stx.stx_nlink;
+            e.uid = stx.stx_uid;
+            e.gid = stx.stx_gid;
+        }
+
+        e.name = names.size();
+        names.insert(names.end(), name, name + std::strlen(name) + 1);
+        entries.push_back(e);
+    }
+
+    // sizes shown by -l, and so sorted by with -S
+    std::vector<const char *> dirnames;
+    for (const auto& e : entries) {
+        if (params.l_flag && S_ISDIR(e.mode)) dirnames.push_back(&names[e.name]);
+    }
+    if (!dirnames.empty()) {
+        size_walker walker { state.cache, state.nthreads, state.board };
+        auto sizes = walker.run(::dirfd(dir), dirnames);
+        for (std::size_t i = 0, j = 0; i < entries.size(); ++i) {
+            if (S_ISDIR(entries[i].mode)) entries[i].size = sizes[j++];
+        }
+    }
+
+    for (auto i : sort_entries(entries, names, params, state.nthreads)) {
+        const auto& e = entries[i];
+        std::string_view name { &names[e.name] };
+        if (subdirs != nullptr && e.is_subdir) subdirs->emplace_back(name);
         if (!params.l_flag) {
-            std::cout << name << ' ';
+            out.put(name).put(' ');
+            continue;
+        }
+
+        auto [fowner, fgroup] = get_fstat(e.uid, e.gid, state.names);
+
+        char *p = out.reserve(PERMS_LEN);
+        permissions(e.mode, p);
+        out.commit(PERMS_LEN);
+        out.put(' ').put(std::uint64_t { e.nlink });
+        out.put(' ').put(fowner).put(' ').put(fgroup);
+        out.put(' ').put(e.size).put(' ');
+        p = out.reserve(TIME_LEN);
+        state.times.format(e.mtime_sec, p);
+        out.commit(TIME_LEN);
+        out.put(' ').put(name).put('\n');
+    }
+    out.put('\n');
+
+    return ret;
+}
+
+/**
+ * -R: the directory and all its subdirectories, each one as "path:" followed
+ * by its listing, depth first in the order of entries.
+ * A pool of threads reads (and stats, and renders) directories into buffers
+ * of their own. Directories wait in a queue ordered by their position in the
+ * output, the path of entry indices from the top, so threads always take the
+ * one which is needed first, and the main thread writes out every buffer as
+ * soon as everything before it is written. Threads stop taking directories
+ * while READAHEAD of them are done but not written yet, except for the one the
+ * output waits for. So memory is bounded by that many listings however large
+ * the tree is, plus names of subdirectories found and not read yet, and with
+ * -l the size cache, which is bounded too (see size_cache).
+ * Sizes for -l are walked by the threads of the pool which have nothing to
+ * list, so the walk of the top directory, which is the whole tree, is not
+ * left to a single thread
+ * A directory is opened relative to the fd of its parent, which is kept open
+ * until all its subdirectories are
+ */
+class tree_lister {
+public:
+    tree_lister(const lsdata& params, size_cache *cache, unsigned nthreads)
+        : params { params }, states(std::max(nthreads, 1u)),
+          board { mtx, cv, std::max(nthreads, 1u), {} } {
+        for (auto& state : states) {
+            state.cache = cache;
+            // the pool already has a thread per CPU, so a directory is sorted
+            // by its own thread only, and its sizes are walked by the threads
+            // of the pool which are free
+            state.nthreads = 1;
+            state.board = &board;
+        }
+    }
+
+    int run(out_buffer& out);
+
+    void report(std::ostream& err) const {
+        for (const auto& state : states) state.names.report(err);
+    }
+
+private:
+    static constexpr std::size_t READAHEAD = 256;
+
+    struct node {
+        std::vector<std::uint32_t> order;
+        std::string path;
+        std::shared_ptr<dir_handle> parent;    // null for the top
+        std::string name;
+        out_buffer text;
+        std::string errors;
+        std::vector<std::shared_ptr<node>> children;
+        int ret {};
+        bool ready {};
+    };
+
+    struct later {
+        bool operator()(const std::shared_ptr<node>& a, const std::shared_ptr<node>& b) const {
+            return a->order > b->order;
+        }
+    };
+
+    const lsdata& params;
+    std::vector<listing_state> states;
+
+    // a lock per directory, not per entry, so it is hardly contended
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::priority_queue<std::shared_ptr<node>, std::vector<std::shared_ptr<node>>, later> todo;
+    std::size_t nready {};
+    const node *awaited {};
+    bool finished {};
+    walk_board board;
+
+    size_walker *walk_to_help() const {
+        for (auto *walk : board.walks) {
+            if (!walk->is_done()) return walk;
+        }
+        return nullptr;
+    }
+
+    void worker(listing_state& state);
+    void list(node& n, listing_state& state);
+};
+
+void tree_lister::list(node& n, listing_state& state) {
+    const char *name = n.parent ? n.name.c_str() : n.path.c_str();
+    DIR *dir = open_dir(n.parent ? n.parent->fd : AT_FDCWD, name);
+    n.parent.reset();
+    if (dir == nullptr) {
+        n.errors.append("Can't open ").append(n.path).append(": ")
+                .append(std::strerror(errno)).append("\n");
+        n.ret = 1;
+        return;
+    }
+    auto self = std::make_shared<dir_handle>(::dirfd(dir), dir);
+
+    // parents, whose walks needed the record, are listed already
+    struct statx stx;
+    if (state.cache != nullptr &&
+        statx(::dirfd(dir), "", AT_EMPTY_PATH, STATX_INO, &stx) == 0)
+        state.cache->drop({ statx_dev(stx), stx.stx_ino });
+
+    std::vector<std::string> subdirs;
+    n.ret = list_dir(dir, params, state, n.text, n.errors, &subdirs);
+
+    std::string prefix = n.path.back() == '/' ? n.path : n.path + '/';
+    for (std::size_t i = 0; i < subdirs.size(); ++i) {
+        auto child = std::make_shared<node>();
+        child->order = n.order;
+        child->order.push_back(i);
+        child->path = prefix + subdirs[i];
+        child->parent = self;
+        child->name = std::move(subdirs[i]);
+        n.children.push_back(std::move(child));
+    }
+}
+
+void tree_lister::worker(listing_state& state) {
+    std::unique_lock lock { mtx };
+    while (true) {
+        auto can_list = [this] {
+            return !todo.empty() && (nready < READAHEAD || todo.top().get() == awaited);
+        };
+        cv.wait(lock, [&] { return finished || can_list() || walk_to_help() != nullptr; });
+        if (finished) return;
+        if (!can_list()) {
+            walk_to_help()->help(lock);
             continue;
         }
 
-        auto perms = permissions(file);
-        auto link_count = fs::hard_link_count(file);
-        auto fsize = get_file_size(file);
-        auto [ftime, fowner, fgroup] = get_fstat(file);
+        auto n = todo.top();
+        todo.pop();
+        lock.unlock();
+        list(*n, state);
+        lock.lock();
 
-        std::cout << perms << ' ' << link_count;
-        std::cout << ' ' << fowner << ' ' << fgroup;
-        std::cout << ' ' << fsize << ' ' << ftime << ' ' << name <<  '\n';
+        n->ready = true;
+        ++nready;
+        for (const auto& child : n->children) todo.push(child);
+        cv.notify_all();
     }
-    std::cout << '\n';
+}
+
+int tree_lister::run(out_buffer& out) {
+    auto top = std::make_shared<node>();
+    top->path = params.dirname;
+    todo.push(top);
+
+    std::vector<std::thread> threads;
+    for (auto& state : states) threads.emplace_back(&tree_lister::worker, this, std::ref(state));
+
+    int ret = 0;
+    const node *root = top.get();
+    std::vector<std::shared_ptr<node>> stack { top };
+    top.reset();
+    while (!stack.empty()) {
+        auto n = std::move(stack.back());
+        stack.pop_back();
+        {
+            std::unique_lock lock { mtx };
+            awaited = n.get();
+            cv.notify_all();
+            cv.wait(lock, [&n] { return n->ready; });
+            awaited = nullptr;
+            --nready;
+            cv.notify_all();
+        }
+
+        // a plain listing has no blank line at the end, -l does
+        if (!params.l_flag && n.get() != root) out.put('\n');
+        std::cerr << n->errors;
+        ret |= n->ret;
+        out.put(std::string_view { n->path }).put(":\n").put(n->text.text());
+        stack.insert(stack.end(), n->children.rbegin(), n->children.rend());
+    }
+
+    {
+        std::lock_guard lock { mtx };
+        finished = true;
+    }
+    cv.notify_all();
+    for (auto& thread : threads) thread.join();
+
+    return ret;
+}
+
+int display(const lsdata& params) {
+    std::unique_ptr<size_cache> cache;
+    if (!params.cachefile.empty()) cache = std::make_unique<size_cache>(params.cachefile);
+    else if (params.R_flag && params.l_flag) cache = std::make_unique<size_cache>();
+
+    int ret = 0;
+    out_buffer out { STDOUT_FILENO };
+    if (params.R_flag) {
+        tree_lister lister { params, cache.get(), std::thread::hardware_concurrency() };
+        ret = lister.run(out);
+        if (DEBUG && params.l_flag) lister.report(std::cerr);
+    } else {
+        DIR *dir = open_dir(AT_FDCWD, params.dirname.c_str());
+        if (dir == nullptr) {
+            std::cerr << "Can't open " << params.dirname << ": " << std::strerror(errno) << '\n';
+            return 1;
+        }
+
+        listing_state state { {}, {}, cache.get(), std::thread::hardware_concurrency() };
+        std::string errors;
+        ret = list_dir(dir, params, state, out, errors, nullptr);
+        closedir(dir);
+        std::cerr << errors;
+        if (DEBUG && params.l_flag) state.names.report(std::cerr);
+    }
+
+    if (int err = cache ? cache->save() : 0) {
+        std::cerr << "Can't save " << params.cachefile << ": " << std::strerror(err) << '\n';
+        ret = 1;
+    }
+    if (!out.flush()) {
+        std::cerr << "Can't write: " << std::strerror(errno) << '\n';
+        ret = 1;
+    }
+
+    return ret;
 }
 
 int main(int argc, char **argv) {
     auto args = parse_args(argc, argv);
     auto data = lsdata::fromRawArgs(args);
-    display(data);
-    
-    return 0;
+
+    // size walks and -R keep a directory per level of the tree open for every
+    // thread, which a deep tree takes past the soft limit, so it is raised once
+    // here to the hard one
+    struct rlimit lim;
+    if (getrlimit(RLIMIT_NOFILE, &lim) == 0 && lim.rlim_cur < lim.rlim_max) {
+        lim.rlim_cur = lim.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &lim);
+    }
+
+    return display(data);
 }
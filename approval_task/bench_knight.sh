@@ -0,0 +1,82 @@
+#!/bin/sh
+# Benchmark of knight listings: times every given binary on the same generated
+# directory and prints JSON.
+#
+# The directory holds NFILES small files and NDIRS subdirectories of
+# SUBFILES files each (their sizes are summed by -l), and is created once in
+# TMPDIR unless DIR points to an existing one. Every binary and mode is run
+# WARMUP times unmeasured (so the dentry and inode caches are hot), then REPS
+# times; the median wall time is reported. Output goes to /dev/null, so this
+# measures gathering the metadata rather than the terminal, or with PIPE=1
+# through a pipe to cat, which is what feeding a listing to other tools costs.
+#
+# Build the binary to compare against from any revision, e.g.
+#   git show HEAD~1:approval_task/3knight.cpp > /tmp/old.cpp
+#   g++ -O2 -std=c++17 -pthread /tmp/old.cpp -o knight_old
+#   g++ -O2 -std=c++17 -pthread 3knight.cpp -o knight
+#
+# Usage: [NFILES=n] [NDIRS=n] [SUBFILES=n] [REPS=n] [WARMUP=n] [MODES="..."] [DIR=path] [PIPE=1]
+#        ./bench_knight.sh knight_old knight > bench_knight.json
+
+NFILES=${NFILES:-200000}
+NDIRS=${NDIRS:-100}
+SUBFILES=${SUBFILES:-100}
+REPS=${REPS:-5}
+WARMUP=${WARMUP:-1}
+MODES=${MODES:-"-a -la"}
+PIPE=${PIPE:-0}
+
+[ $# -gt 0 ] || { echo "Usage: $0 knight [knight ...]" >&2; exit 1; }
+
+if [ -z "$DIR" ]; then
+    DIR=$(mktemp -d "${TMPDIR:-/tmp}/bench_knight.XXXXXX") || exit 1
+    trap 'rm -rf "$DIR" "$DIR.status"' EXIT
+    echo "Creating $NFILES files and $NDIRS directories in $DIR" >&2
+    (cd "$DIR" && seq -f "file%.0f" 1 "$NFILES" | xargs touch) || exit 1
+    for d in $(seq 1 "$NDIRS"); do
+        mkdir "$DIR/dir$d" && (cd "$DIR/dir$d" && seq -f "%.0f" 1 "$SUBFILES" | xargs touch)
+    done
+fi
+
+now_ns() { date +%s%N; }
+
+# exit status of knight, not of cat
+list() {
+    if [ "$PIPE" = 1 ]; then
+        { "$1" "$2" "$3"; echo $? > "$DIR.status"; } | cat > /dev/null
+        return "$(cat "$DIR.status")"
+    fi
+    "$1" "$2" "$3" > /dev/null
+}
+
+printf '{\n  "host": "%s",\n  "dir": "%s",\n' "$(uname -n)" "$DIR"
+printf '  "entries": %s,\n  "reps": %s,\n  "warmup": %s,\n  "pipe": %s,\n' \
+       "$(ls -A "$DIR" | wc -l)" "$REPS" "$WARMUP" "$PIPE"
+printf '  "results": ['
+
+sep=""
+for bin in "$@"; do
+    for mode in $MODES; do
+        i=0
+        while [ "$i" -lt "$WARMUP" ]; do
+            list "$bin" "$mode" "$DIR" || { echo "$bin $mode failed" >&2; exit 1; }
+            i=$((i + 1))
+        done
+
+        times=""
+        i=0
+        while [ "$i" -lt "$REPS" ]; do
+            start=$(now_ns)
+            list "$bin" "$mode" "$DIR" || { echo "$bin $mode failed" >&2; exit 1; }
+            times="$times $(( $(now_ns) - start ))"
+            i=$((i + 1))
+        done
+
+        median=$(echo $times | tr ' ' '\n' | sort -n |
+                 awk '{ t[NR] = $1 } END { printf "%.6f", (t[int((NR + 1) / 2)] + t[int(NR / 2) + 1]) / 2e9 }')
+        printf '%s\n    { "binary": "%s", "mode": "%s", "median_s": %s }' \
+               "$sep" "$bin" "$mode" "$median"
+        sep=","
+    done
+done
+printf '\n  ]\n}\n'
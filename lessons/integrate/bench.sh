@@ -0,0 +1,57 @@
+#!/bin/sh
+# Benchmark of dlintegrate: sweeps plugins x nsteps x nthreads and prints JSON.
+#
+# Every configuration is a single dlintegrate process doing WARMUP unmeasured and
+# REPS measured runs with the same threads and loaded library (-w/-r), timed with
+# CLOCK_MONOTONIC. Setup (library loading and thread start) is reported apart.
+# Parallel efficiency is T(p0) * p0 / (T(p) * p), where p0 is the first entry of
+# THREADS (1 by default), so 1.0 is perfect scaling.
+#
+# Usage: [PLUGINS=...] [NSTEPS=...] [THREADS=...] [REPS=n] [WARMUP=n] [METHOD=rule]
+#        ./bench.sh [dir with dlintegrate and plugins] > bench.json
+
+BINDIR=${1:-.}
+NPROC=$(nproc)
+PLUGINS=${PLUGINS:-"sin cos"}
+NSTEPS=${NSTEPS:-"1e6 1e7 1e8"}
+THREADS=${THREADS:-$(t=1; while [ "$t" -lt "$NPROC" ]; do printf "%s " "$t"; t=$((t * 2)); done; echo "$NPROC")}
+REPS=${REPS:-10}
+WARMUP=${WARMUP:-2}
+METHOD=${METHOD:-left}
+
+printf '{\n  "host": "%s",\n  "nproc": %s,\n' "$(uname -n)" "$NPROC"
+printf '  "reps": %s,\n  "warmup": %s,\n  "method": "%s",\n' "$REPS" "$WARMUP" "$METHOD"
+printf '  "results": ['
+
+sep=""
+for plugin in $PLUGINS; do
+    for nsteps in $NSTEPS; do
+        base=""
+        for nthreads in $THREADS; do
+            out=$("$BINDIR/dlintegrate" -v -m "$METHOD" -t "$nthreads" -n "$nsteps" \
+                  -r "$REPS" -w "$WARMUP" -F "$plugin" 0 1 2>&1 >/dev/null) || {
+                echo "dlintegrate failed for $plugin $nsteps $nthreads" >&2
+                exit 1
+            }
+            # base is "median threads" of the first thread count
+            line=$(echo "$out" | awk -v p="$nthreads" -v base="$base" '
+                /^Evaluations/ { evals = $2 }
+                /^Setup/       { setup = $2 }
+                /^Took/        { median = $2 }
+                /^P95/         { p95 = $2 }
+                END {
+                    if (p95 == "") p95 = median
+                    if (base == "") { bt = median; bp = p } else { split(base, b, " "); bt = b[1]; bp = b[2] }
+                    printf "%s %s|\"evals\": %s, \"setup_s\": %s, \"median_s\": %s, \"p95_s\": %s, " \
+                           "\"evals_per_s\": %.6g, \"efficiency\": %.4f",
+                           median, p, evals, setup, median, p95,
+                           evals / median, (bt * bp) / (median * p)
+                }')
+            [ -z "$base" ] && base=${line%%|*}
+            printf '%s\n    {"plugin": "%s", "nsteps": %s, "nthreads": %s, %s}' \
+                   "$sep" "$plugin" "$nsteps" "$nthreads" "${line#*|}"
+            sep=","
+        done
+    done
+done
+printf '\n  ]\n}\n'
@@ -0,0 +1,29 @@
+#!/bin/sh
+# Throughput and error of the float, double and long double hot loops of dlintegrate.
+# Integrates sin over [0; pi] (exactly 2) with 10^6..10^9 steps.
+#
+# Usage: ./bench_precision.sh [dir with dlintegrate and dlfunc_sin.so] [threads] [method]
+
+BINDIR=${1:-.}
+THREADS=${2:-0}
+METHOD=${3:-midpoint}
+PI=3.14159265358979323846
+EXACT=2
+
+printf "%-9s %12s %12s %14s %12s\n" precision nsteps "time, s" "evals/s" "abs error"
+for prec in double float ldouble; do
+    for nsteps in 1e6 1e7 1e8 1e9; do
+        # -v puts "Evaluations" and "Took" lines to stderr, the result goes to stdout
+        "$BINDIR/dlintegrate" -v -t "$THREADS" -m "$METHOD" -p "$prec" -n "$nsteps" \
+            -F sin 0 "$PI" 2>&1 |
+        awk -v prec="$prec" -v nsteps="$nsteps" -v exact="$EXACT" '
+            /^Evaluations/ { evals = $2 }
+            /^Took/        { took = $2 }
+            /^[-0-9.]/     { res = $1 }
+            END {
+                err = res - exact
+                printf "%-9s %12s %12.6f %14.4g %12.3g\n",
+                       prec, nsteps, took, evals / took, err < 0 ? -err : err
+            }'
+    done
+done
@@ -0,0 +1,355 @@
+/**
+ * Client for the dlintegrate daemon (dlintegrate -D socket).
+ *
+ * Sends job lines 'funcname start end [steps [method]]' to the daemon over
+ * a Unix domain socket and prints one result line per job. Jobs are taken from
+ * the positional arguments, or from stdin if there are none.
+ *
+ * With -N it becomes a load test instead: -c connections send the jobs (cycling
+ * over them) until N requests are done in total, one request at a time per
+ * connection, and latency percentiles and throughput are reported.
+ */
+
+// gcc -O2 -std=gnu18 dlclient.c -pthread -o ./dlclient
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sysexits.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+enum error {
+    PE_OK = 0,          /* No error                                        */
+    PE_WRONGARG,        /* Argument has wrong format                       */
+    PE_NENARGS,         /* Not enough arguments                            */
+    PE_MALLOC,          /* Memory allocation error                         */
+    PE_THREAD,          /* Threading error                                 */
+    PE_SOCKET,          /* Socket error                                    */
+    __PE_LAST           /* Last item. So that array sizes match everywhere */
+};
+
+static const char *const error_msg[] = {
+    [PE_OK]       = "",
+    [PE_WRONGARG] = "Wrong argument '%s'",
+    [PE_NENARGS]  = "Not enough arguments",
+    [PE_MALLOC]   = "Could not allocate memory",
+    [PE_THREAD]   = "Threading error",
+    [PE_SOCKET]   = "Socket error on '%s'",
+    [__PE_LAST]   = NULL
+};
+
+static const int error_retcodes[] = {
+    [PE_OK]       = EXIT_SUCCESS,
+    [PE_WRONGARG] = EX_USAGE,
+    [PE_NENARGS]  = EX_USAGE,
+    [PE_MALLOC]   = EX_OSERR,
+    [PE_THREAD]   = EX_OSERR,
+    [PE_SOCKET]   = EX_UNAVAILABLE,
+    [__PE_LAST]   = EXIT_FAILURE
+};
+
+static const char *const USAGE = (
+    "Send integration jobs to the dlintegrate daemon.\n\n"
+    "Usage: %s -s socket [job ...]\n"
+    "       %1$s -s socket -N requests [-c connections] job [job ...]\n"
+);
+
+
+static void err_handler(enum error err, const char *etc)
+{
+    if (PE_OK == err)
+        return;
+
+    fprintf(stderr, "Error: ");
+    fprintf(stderr, error_msg[err], etc);
+    fprintf(stderr, ".\n");
+    exit(error_retcodes[err]);
+}
+
+
+struct args {
+    const char *sockname;
+    long long nrequests;      // load test when not 0
+    long long nconnections;
+    char **jobs;
+    int njobs;
+};
+
+static struct args parse_args(int argc, char *argv[])
+{
+    struct args args = { .nconnections = 1 };
+
+    for (int sym; (sym = getopt(argc, argv, "hs:N:c:")) != -1;) {
+        char *end;
+        switch (sym) {
+        case 'h':
+            fprintf(stderr, USAGE, argv[0]);
+            exit(EXIT_SUCCESS);
+        case 's':
+            args.sockname = optarg;
+            break;
+        case 'N':
+            args.nrequests = strtoll(optarg, &end, 10);
+            if (*end || (args.nrequests <= 0))
+                err_handler(PE_WRONGARG, optarg);
+            break;
+        case 'c':
+            args.nconnections = strtoll(optarg, &end, 10);
+            if (*end || (args.nconnections <= 0))
+                err_handler(PE_WRONGARG, optarg);
+            break;
+        default:
+            fprintf(stderr, USAGE, argv[0]);
+            err_handler(PE_WRONGARG, argv[optind - 1]);
+        }
+    }
+
+    args.jobs = &argv[optind];
+    args.njobs = argc - optind;
+
+    if ((NULL == args.sockname) || (args.nrequests && !args.njobs)) {
+        fprintf(stderr, USAGE, argv[0]);
+        err_handler(PE_NENARGS, NULL);
+    }
+
+    return args;
+}
+
+
+// Connected socket wrapped into streams for line-based exchange
+struct conn {
+    FILE *in;
+    FILE *out;
+};
+
+// errno of the last socket failure, reported at exit since streams and frees
+// on the way there change errno
+static int socket_errno;
+
+static enum error socket_error(int errnum)
+{
+    __atomic_store_n(&socket_errno, errnum, __ATOMIC_RELAXED);
+    return PE_SOCKET;
+}
+
+static enum error conn_open(const char *sockname, struct conn *conn)
+{
+    enum error err;
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(sockname) >= sizeof addr.sun_path)
+        return PE_WRONGARG;
+    strcpy(addr.sun_path, sockname);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return socket_error(errno);
+
+    if (connect(fd, (struct sockaddr *)&addr, sizeof addr)) {
+        err = socket_error(errno);
+        close(fd);
+        return err;
+    }
+
+    // separate streams for both directions, each owns its fd
+    conn->in = fdopen(fd, "r");
+    if (NULL == conn->in) {
+        close(fd);
+        return PE_MALLOC;
+    }
+    int outfd = dup(fd);
+    if (outfd < 0) {
+        err = socket_error(errno);
+        fclose(conn->in);
+        return err;
+    }
+    conn->out = fdopen(outfd, "w");
+    if (NULL == conn->out) {
+        close(outfd);
+        fclose(conn->in);
+        return PE_MALLOC;
+    }
+    return PE_OK;
+}
+
+static void conn_close(struct conn *conn)
+{
+    fclose(conn->out);
+    fclose(conn->in);
+}
+
+// Send len chars of a job and wait for its result line. Returns false if the
+// daemon has gone
+static bool conn_request(struct conn *conn, const char *job, size_t len,
+                         char **line, size_t *linecap)
+{
+    fprintf(conn->out, "%.*s\n", (int)len, job);
+    if (fflush(conn->out)) {
+        socket_error(errno);
+        return false;
+    }
+    if (getline(line, linecap, conn->in) < 0) {
+        // the end of the stream is the daemon closing the connection
+        socket_error(ferror(conn->in) ? errno : ECONNRESET);
+        return false;
+    }
+    return true;
+}
+
+
+static long long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+struct loader {
+    const struct args *args;
+    long long next;             // next request number, shared
+    long long *latencies_ns;    // one per request
+    long long nerrors;          // 'error:' responses and lost connections
+    enum error err;
+};
+
+static void *load_worker(void *argsptr)
+{
+    struct loader *ld = argsptr;
+    struct conn conn;
+    char *line = NULL;
+    size_t linecap = 0;
+
+    enum error err = conn_open(ld->args->sockname, &conn);
+    if (PE_OK != err) {
+        __atomic_store_n(&ld->err, err, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    for (long long i; (i = __atomic_fetch_add(&ld->next, 1, __ATOMIC_RELAXED)) <
+                      ld->args->nrequests;) {
+        const char *job = ld->args->jobs[i % ld->args->njobs];
+
+        long long start = now_ns();
+        bool isok = conn_request(&conn, job, strlen(job), &line, &linecap);
+        ld->latencies_ns[i] = now_ns() - start;
+
+        if (!isok || !strncmp(line, "error:", 6))
+            __atomic_fetch_add(&ld->nerrors, 1, __ATOMIC_RELAXED);
+        if (!isok)
+            break;
+    }
+
+    free(line);
+    conn_close(&conn);
+    return NULL;
+}
+
+static int cmp_ll(const void *a, const void *b)
+{
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+static enum error run_load(const struct args *args)
+{
+    enum error err = PE_OK;
+    struct loader ld = { .args = args };
+
+    ld.latencies_ns = calloc(args->nrequests, sizeof *ld.latencies_ns);
+    pthread_t *threads = calloc(args->nconnections, sizeof *threads);
+    if ((NULL == ld.latencies_ns) || (NULL == threads)) {
+        err = PE_MALLOC;
+        goto alloc_exc;
+    }
+
+    long long start = now_ns();
+    long long nstarted = 0;
+    for (; nstarted < args->nconnections; nstarted++) {
+        if (pthread_create(&threads[nstarted], NULL, &load_worker, &ld)) {
+            err = PE_THREAD;
+            break;
+        }
+    }
+    for (long long i = 0; i < nstarted; i++)
+        pthread_join(threads[i], NULL);
+    long long took = now_ns() - start;
+
+    err = (PE_OK != err) ? err : ld.err;
+    if (PE_OK != err)
+        goto alloc_exc;
+
+    long long ndone = (ld.next < args->nrequests) ? ld.next : args->nrequests;
+    qsort(ld.latencies_ns, ndone, sizeof *ld.latencies_ns, &cmp_ll);
+
+    long long pct(int p) { return ld.latencies_ns[(ndone - 1) * p / 100] / 1000; }
+
+    printf("requests     %lld\n", ndone);
+    printf("connections  %lld\n", args->nconnections);
+    printf("errors       %lld\n", ld.nerrors);
+    printf("took         %.6f s\n", took / 1e9);
+    printf("throughput   %.1f req/s\n", ndone / (took / 1e9));
+    printf("latency p50  %lld us\n", pct(50));
+    printf("latency p95  %lld us\n", pct(95));
+    printf("latency p99  %lld us\n", pct(99));
+    printf("latency max  %lld us\n", pct(100));
+
+alloc_exc:
+    free(threads);
+    free(ld.latencies_ns);
+    return err;
+}
+
+
+static enum error run_jobs(const struct args *args)
+{
+    struct conn conn;
+    enum error err = conn_open(args->sockname, &conn);
+    if (PE_OK != err)
+        return err;
+
+    char *line = NULL, *job = NULL;
+    size_t linecap = 0, jobcap = 0;
+    for (int i = 0; args->njobs ? (i < args->njobs) : (getline(&job, &jobcap, stdin) >= 0);
+         i++) {
+        const char *cur = args->njobs ? args->jobs[i] : job;
+        size_t len = strcspn(cur, "\n");
+
+        // the daemon does not answer these
+        size_t skip = strspn(cur, " \t\n");
+        if (('\0' == cur[skip]) || ('#' == cur[skip]))
+            continue;
+
+        // not copied: anything on the stack here would pile up until return
+        if (!conn_request(&conn, cur, len, &line, &linecap)) {
+            err = PE_SOCKET;
+            break;
+        }
+        fputs(line, stdout);
+    }
+
+    free(job);
+    free(line);
+    conn_close(&conn);
+    return err;
+}
+
+
+int main(int argc, char *argv[])
+{
+    struct args args = parse_args(argc, argv);
+    // a daemon which has gone is reported by the failed write, not by a signal
+    signal(SIGPIPE, SIG_IGN);
+
+    enum error err = args.nrequests ? run_load(&args) : run_jobs(&args);
+    if (PE_SOCKET == err)
+        fprintf(stderr, "%s: %s\n", args.sockname, strerror(socket_errno));
+    err_handler(err, args.sockname);
+    return 0;
+}
@@ -0,0 +1,433 @@
+/**
+ * Expression compiler and block interpreter for dlintegrate -E, see dlexpr.h.
+ *
+ * The program is a sequence of stack machine instructions. Operands are whole
+ * blocks of EXPR_BLOCK values, so the stack is a small 2D array which stays in L1
+ * and every instruction is a loop the compiler can vectorize. Constants are folded
+ * at compile time, and operations with a constant operand get their own opcodes
+ * (x*3 is a single MULC), so constants never take a stack slot.
+ *
+ * Same as the plugins, this is built with -ffast-math -fopenmp-simd: glibc math.h
+ * declares SIMD variants of the math functions (libmvec) under -ffast-math only.
+ */
+
+// gcc -O2 -ffast-math -fopenmp-simd -std=gnu18 -c dlexpr.c -o dlexpr.o
+
+#define _GNU_SOURCE
+#include "dlexpr.h"
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <tgmath.h>             /* same math code for every precision  */
+
+// Points per instruction. Stack rows of this size must stay in L1
+#define EXPR_BLOCK 256
+// Limits keep the stack of the interpreter and of the parser small
+#define EXPR_MAX_DEPTH 32
+#define EXPR_MAX_NESTING 64
+
+
+// Operations as X-macros: a and b are operands, expression gives the result.
+// Every binary operation gets three opcodes: OP_NAME for two stack operands,
+// OP_NAMEC with constant b and OP_RNAMEC with constant a
+#define UNARY_OPS(X)            \
+    X(NEG, -a)                  \
+    X(SQR, a * a)               \
+    X(SIN, sin(a))              \
+    X(COS, cos(a))              \
+    X(TAN, tan(a))              \
+    X(ASIN, asin(a))            \
+    X(ACOS, acos(a))            \
+    X(ATAN, atan(a))            \
+    X(SINH, sinh(a))            \
+    X(COSH, cosh(a))            \
+    X(TANH, tanh(a))            \
+    X(EXP, exp(a))              \
+    X(LOG, log(a))              \
+    X(LOG10, log10(a))          \
+    X(SQRT, sqrt(a))            \
+    X(CBRT, cbrt(a))            \
+    X(ABS, fabs(a))             \
+    X(FLOOR, floor(a))          \
+    X(CEIL, ceil(a))
+
+#define BINARY_OPS(X)           \
+    X(ADD, a + b)               \
+    X(SUB, a - b)               \
+    X(MUL, a * b)               \
+    X(DIV, a / b)               \
+    X(POW, pow(a, b))           \
+    X(ATAN2, atan2(a, b))       \
+    X(MIN, fmin(a, b))          \
+    X(MAX, fmax(a, b))
+
+enum opcode {
+    OP_X,           /* push the points          */
+    OP_CONST,       /* push a constant          */
+#define X(name, expression) OP_##name,
+    UNARY_OPS(X)
+#undef X
+#define X(name, expression) OP_##name, OP_##name##C, OP_R##name##C,
+    BINARY_OPS(X)
+#undef X
+};
+
+struct expr_op {
+    enum opcode code;
+    long double value;    // constant of OP_CONST and OP_*C, in the widest precision
+};
+
+struct expr {
+    struct expr_op *ops;
+    int nops;
+    int maxdepth;    // stack rows needed
+};
+
+
+// Functions callable by name
+static const struct function {
+    const char *name;
+    enum opcode code;
+    int nargs;
+} FUNCTIONS[] = {
+    { "sin", OP_SIN, 1 },     { "cos", OP_COS, 1 },     { "tan", OP_TAN, 1 },
+    { "asin", OP_ASIN, 1 },   { "acos", OP_ACOS, 1 },   { "atan", OP_ATAN, 1 },
+    { "sinh", OP_SINH, 1 },   { "cosh", OP_COSH, 1 },   { "tanh", OP_TANH, 1 },
+    { "exp", OP_EXP, 1 },     { "log", OP_LOG, 1 },     { "log10", OP_LOG10, 1 },
+    { "sqrt", OP_SQRT, 1 },   { "cbrt", OP_CBRT, 1 },   { "abs", OP_ABS, 1 },
+    { "floor", OP_FLOOR, 1 }, { "ceil", OP_CEIL, 1 },   { "pow", OP_POW, 2 },
+    { "atan2", OP_ATAN2, 2 }, { "min", OP_MIN, 2 },     { "max", OP_MAX, 2 },
+};
+#define NFUNCTIONS (sizeof FUNCTIONS / sizeof FUNCTIONS[0])
+
+
+// Used for constant folding only, b is ignored by unary operations
+static long double apply(enum opcode code, long double a, long double b)
+{
+    switch (code) {
+#define X(name, expression) case OP_##name: return expression;
+    UNARY_OPS(X)
+    BINARY_OPS(X)
+#undef X
+    default:
+        return NAN;    // never reached
+    }
+}
+
+static int stack_effect(enum opcode code)
+{
+    switch (code) {
+    case OP_X:
+    case OP_CONST:
+        return 1;
+#define X(name, expression) case OP_##name: return -1;
+    BINARY_OPS(X)
+#undef X
+    default:
+        return 0;
+    }
+}
+
+
+// Recursive descent parser emitting instructions as it goes:
+//      expr    := term { ('+' | '-') term }
+//      term    := unary { ('*' | '/') unary }
+//      unary   := ('-' | '+') unary | power
+//      power   := primary [ ('^' | '**') unary ]
+//      primary := number | 'x' | 'pi' | 'e' | function '(' expr [',' expr] ')'
+//                 | '(' expr ')'
+// Every parse_*() returns false on error, the first error is kept
+struct parser {
+    const char *src;
+    const char *cur;
+    struct expr_op *ops;
+    int nops;
+    int capacity;
+    int depth;
+    int maxdepth;
+    int nesting;
+    const char *errmsg;
+    size_t errpos;
+};
+
+static bool fail(struct parser *p, const char *msg)
+{
+    if (NULL == p->errmsg) {
+        p->errmsg = msg;
+        p->errpos = p->cur - p->src;
+    }
+    return false;
+}
+
+static bool accept(struct parser *p, const char *token)
+{
+    while (isspace((unsigned char)*p->cur))
+        p->cur++;
+    size_t len = strlen(token);
+    if (strncmp(p->cur, token, len))
+        return false;
+    p->cur += len;
+    return true;
+}
+
+static bool emit(struct parser *p, enum opcode code, long double value)
+{
+    if (p->nops == p->capacity) {
+        int capacity = p->capacity ? 2 * p->capacity : 16;
+        struct expr_op *ops = realloc(p->ops, capacity * sizeof *ops);
+        if (NULL == ops)
+            return fail(p, "out of memory");
+        p->ops = ops;
+        p->capacity = capacity;
+    }
+    p->ops[p->nops++] = (struct expr_op){ .code = code, .value = value };
+
+    p->depth += stack_effect(code);
+    if (p->depth > p->maxdepth)
+        p->maxdepth = p->depth;
+    if (p->maxdepth > EXPR_MAX_DEPTH)
+        return fail(p, "expression is too complex");
+    return true;
+}
+
+// A complete operand ending with OP_CONST can be nothing but that constant
+static bool is_const(const struct parser *p, int end)
+{
+    return (end > 0) && (OP_CONST == p->ops[end - 1].code);
+}
+
+static bool emit_unary(struct parser *p, enum opcode code)
+{
+    if (is_const(p, p->nops)) {
+        struct expr_op *arg = &p->ops[p->nops - 1];
+        arg->value = apply(code, arg->value, 0);
+        return true;
+    }
+    return emit(p, code, 0);
+}
+
+// The left operand has been emitted before rstart, the right one from rstart
+static bool emit_binary(struct parser *p, enum opcode code, int rstart)
+{
+    bool islconst = is_const(p, rstart);
+    bool isrconst = (rstart == p->nops - 1) && is_const(p, p->nops);
+
+    if (islconst && isrconst) {
+        p->ops[rstart - 1].value = apply(code, p->ops[rstart - 1].value, p->ops[rstart].value);
+        p->nops--;
+        p->depth--;
+        return true;
+    }
+    if (isrconst) {
+        long double c = p->ops[--p->nops].value;
+        p->depth--;
+        if ((OP_POW == code) && (2 == c))
+            return emit(p, OP_SQR, 0);
+        return emit(p, code + 1, c);    // OP_NAMEC
+    }
+    if (islconst) {
+        long double c = p->ops[rstart - 1].value;
+        memmove(&p->ops[rstart - 1], &p->ops[rstart], (p->nops - rstart) * sizeof *p->ops);
+        p->nops--;
+        p->depth--;
+        return emit(p, code + 2, c);    // OP_RNAMEC
+    }
+    return emit(p, code, 0);
+}
+
+static bool parse_expr(struct parser *p);
+static bool parse_unary(struct parser *p);
+
+static bool parse_primary(struct parser *p)
+{
+    while (isspace((unsigned char)*p->cur))
+        p->cur++;
+    const char *start = p->cur;
+
+    if (isdigit((unsigned char)*start) || ('.' == *start)) {
+        char *end;
+        long double value = strtold(start, &end);
+        if (end == start)
+            return fail(p, "number expected");
+        p->cur = end;
+        return emit(p, OP_CONST, value);
+    }
+
+    if (accept(p, "(")) {
+        if (++p->nesting > EXPR_MAX_NESTING)
+            return fail(p, "too many nested parentheses");
+        if (!parse_expr(p))
+            return false;
+        p->nesting--;
+        return accept(p, ")") || fail(p, "')' expected");
+    }
+
+    if (!isalpha((unsigned char)*start))
+        return fail(p, ('\0' == *start) ? "unexpected end" : "unexpected character");
+
+    size_t len = 0;
+    while (isalnum((unsigned char)start[len]) || ('_' == start[len]))
+        len++;
+    p->cur += len;
+
+    if ((1 == len) && ('x' == *start))
+        return emit(p, OP_X, 0);
+    if ((2 == len) && !strncmp(start, "pi", 2))
+        return emit(p, OP_CONST, M_PIl);
+    if ((1 == len) && ('e' == *start))
+        return emit(p, OP_CONST, M_El);
+
+    const struct function *func = NULL;
+    for (size_t i = 0; i < NFUNCTIONS; i++) {
+        if ((strlen(FUNCTIONS[i].name) == len) && !strncmp(start, FUNCTIONS[i].name, len))
+            func = &FUNCTIONS[i];
+    }
+    if (NULL == func) {
+        p->cur = start;
+        return fail(p, "unknown name");
+    }
+
+    if (!accept(p, "("))
+        return fail(p, "'(' expected");
+    if (++p->nesting > EXPR_MAX_NESTING)
+        return fail(p, "too many nested parentheses");
+    if (!parse_expr(p))
+        return false;
+    if (2 == func->nargs) {
+        int rstart = p->nops;
+        if (!accept(p, ",") || !parse_expr(p))
+            return fail(p, "',' expected");
+        if (!emit_binary(p, func->code, rstart))
+            return false;
+    } else if (!emit_unary(p, func->code))
+        return false;
+    p->nesting--;
+    return accept(p, ")") || fail(p, "')' expected");
+}
+
+static bool parse_power(struct parser *p)
+{
+    if (!parse_primary(p))
+        return false;
+    if (accept(p, "^") || accept(p, "**")) {
+        int rstart = p->nops;
+        return parse_unary(p) && emit_binary(p, OP_POW, rstart);
+    }
+    return true;
+}
+
+static bool parse_unary(struct parser *p)
+{
+    if (accept(p, "-")) {
+        if (++p->nesting > EXPR_MAX_NESTING)
+            return fail(p, "too many nested signs");
+        bool isok = parse_unary(p) && emit_unary(p, OP_NEG);
+        p->nesting--;
+        return isok;
+    }
+    if (accept(p, "+"))
+        return parse_unary(p);
+    return parse_power(p);
+}
+
+static bool parse_term(struct parser *p)
+{
+    if (!parse_unary(p))
+        return false;
+    for (;;) {
+        enum opcode code;
+        // '**' is a power and has been taken by parse_power() already
+        if (accept(p, "*"))
+            code = OP_MUL;
+        else if (accept(p, "/"))
+            code = OP_DIV;
+        else
+            return true;
+        int rstart = p->nops;
+        if (!parse_unary(p) || !emit_binary(p, code, rstart))
+            return false;
+    }
+}
+
+static bool parse_expr(struct parser *p)
+{
+    if (!parse_term(p))
+        return false;
+    for (;;) {
+        enum opcode code;
+        if (accept(p, "+"))
+            code = OP_ADD;
+        else if (accept(p, "-"))
+            code = OP_SUB;
+        else
+            return true;
+        int rstart = p->nops;
+        if (!parse_term(p) || !emit_binary(p, code, rstart))
+            return false;
+    }
+}
+
+
+struct expr *expr_compile(const char *src, size_t *errpos, const char **errmsg)
+{
+    struct parser p = { .src = src, .cur = src };
+
+    if (parse_expr(&p)) {
+        while (isspace((unsigned char)*p.cur))
+            p.cur++;
+        if ('\0' != *p.cur)
+            fail(&p, "unexpected character");
+    }
+
+    struct expr *expr = NULL;
+    if (NULL == p.errmsg) {
+        expr = malloc(sizeof *expr);
+        if (NULL == expr)
+            fail(&p, "out of memory");
+    }
+    if (NULL != p.errmsg) {
+        if (NULL != errpos)
+            *errpos = p.errpos;
+        if (NULL != errmsg)
+            *errmsg = p.errmsg;
+        free(p.ops);
+        return NULL;
+    }
+
+    *expr = (struct expr){ .ops = p.ops, .nops = p.nops, .maxdepth = p.maxdepth };
+    return expr;
+}
+
+void expr_free(struct expr *expr)
+{
+    if (NULL == expr)
+        return;
+    free(expr->ops);
+    free(expr);
+}
+
+int expr_length(const struct expr *expr)
+{
+    return expr->nops;
+}
+
+
+// expr_eval(), expr_evalf() and expr_evall()
+#define KERNEL_T double
+#define KERNEL_SFX
+#include "dlexpr_kernel.h"
+#undef KERNEL_SFX
+#undef KERNEL_T
+
+#define KERNEL_T float
+#define KERNEL_SFX f
+#include "dlexpr_kernel.h"
+#undef KERNEL_SFX
+#undef KERNEL_T
+
+#define KERNEL_T long double
+#define KERNEL_SFX l
+#include "dlexpr_kernel.h"
+#undef KERNEL_SFX
+#undef KERNEL_T
@@ -0,0 +1,38 @@
+/**
+ * Built-in integrands: arithmetic expressions of x compiled into bytecode.
+ *
+ * An expression like "exp(-x*x)*cos(3*x)" is parsed once into a short program
+ * for a stack machine. The machine works on whole blocks of points: every
+ * instruction is a simple loop over the block, which the compiler turns into
+ * SIMD code (with libmvec for the math functions), so the interpreter overhead
+ * is paid once per block and not once per point.
+ *
+ * Supported are numbers, x, pi, e, + - * / ^ (or **), parentheses and functions
+ * sin cos tan asin acos atan sinh cosh tanh exp log log10 sqrt cbrt abs floor ceil,
+ * pow(a, b), atan2(a, b), min(a, b), max(a, b).
+ */
+
+#ifndef DLEXPR_H
+#define DLEXPR_H
+
+#include <stddef.h>
+
+struct expr;
+
+// Compile src. On failure NULL is returned, and if errpos and errmsg are not NULL
+// they are set to the offset in src and to a static description of the problem
+struct expr *expr_compile(const char *src, size_t *errpos, const char **errmsg);
+void expr_free(struct expr *expr);
+
+// Number of bytecode instructions, constants are folded at compile time
+int expr_length(const struct expr *expr);
+
+// ys[i] = expr(xs[i]) for i in [0; n), same as the batched plugin entry points
+void expr_eval(const struct expr *expr, const double *restrict xs, double *restrict ys,
+               size_t n);
+void expr_evalf(const struct expr *expr, const float *restrict xs, float *restrict ys,
+                size_t n);
+void expr_evall(const struct expr *expr, const long double *restrict xs,
+                long double *restrict ys, size_t n);
+
+#endif /* DLEXPR_H */
@@ -0,0 +1,88 @@
+/**
+ * Precision dependent part of dlexpr.c -- the block interpreter.
+ *
+ * Included once per floating point type, same as libintegrate_kernel.h:
+ *      KERNEL_T    -- the type itself
+ *      KERNEL_SFX  -- suffix of expr_eval, empty for double, f for float and l
+ *                     for long double
+ * Math functions come from tgmath.h, so sin() of a float is sinf() here.
+ */
+
+#define KCAT_(a, b) a##b
+#define KCAT(a, b) KCAT_(a, b)
+#define KFN(name) KCAT(name, KERNEL_SFX)
+
+#define SIMD_LOOP(i, n) _Pragma("omp simd") for (size_t i = 0; i < (n); i++)
+
+void KFN(expr_eval)(const struct expr *expr, const KERNEL_T *restrict xs,
+                    KERNEL_T *restrict ys, size_t n)
+{
+    KERNEL_T stack[expr->maxdepth][EXPR_BLOCK];
+
+    for (size_t start = 0; start < n; start += EXPR_BLOCK) {
+        size_t m = (n - start < EXPR_BLOCK) ? n - start : EXPR_BLOCK;
+        const KERNEL_T *x = &xs[start];
+        int top = -1;
+
+        for (const struct expr_op *op = expr->ops; op < &expr->ops[expr->nops]; op++) {
+            KERNEL_T c = op->value;
+            switch (op->code) {
+            case OP_X: {
+                KERNEL_T *r = stack[++top];
+                SIMD_LOOP(i, m) r[i] = x[i];
+                break;
+            }
+            case OP_CONST: {
+                KERNEL_T *r = stack[++top];
+                SIMD_LOOP(i, m) r[i] = c;
+                break;
+            }
+#define X(name, expression)                                     \
+            case OP_##name: {                                   \
+                KERNEL_T *r = stack[top];                       \
+                SIMD_LOOP(i, m) {                               \
+                    KERNEL_T a = r[i];                          \
+                    r[i] = (expression);                        \
+                }                                               \
+                break;                                          \
+            }
+            UNARY_OPS(X)
+#undef X
+#define X(name, expression)                                     \
+            case OP_##name: {                                   \
+                KERNEL_T *r = stack[--top], *q = stack[top + 1];\
+                SIMD_LOOP(i, m) {                               \
+                    KERNEL_T a = r[i], b = q[i];                \
+                    r[i] = (expression);                        \
+                }                                               \
+                break;                                          \
+            }                                                   \
+            case OP_##name##C: {                                \
+                KERNEL_T *r = stack[top], b = c;                \
+                SIMD_LOOP(i, m) {                               \
+                    KERNEL_T a = r[i];                          \
+                    r[i] = (expression);                        \
+                }                                               \
+                break;                                          \
+            }                                                   \
+            case OP_R##name##C: {                               \
+                KERNEL_T *r = stack[top], a = c;                \
+                SIMD_LOOP(i, m) {                               \
+                    KERNEL_T b = r[i];                          \
+                    r[i] = (expression);                        \
+                }                                               \
+                break;                                          \
+            }
+            BINARY_OPS(X)
+#undef X
+            }
+        }
+
+        memcpy(&ys[start], stack[0], m * sizeof *ys);
+    }
+}
+
+#undef SIMD_LOOP
+#undef KFN
+#undef KCAT
+#undef KCAT_
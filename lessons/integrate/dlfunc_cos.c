@@ -1,8 +1,23 @@
-// gcc -O2 ./dlfunc_cos.c -lm -shared -o dlfunc_cos.so
+// gcc -O2 -ffast-math -fopenmp-simd ./dlfunc_cos.c -lm -shared -o dlfunc_cos.so
+// -ffast-math together with -fopenmp-simd lets gcc call vector cos from libmvec
 #include <math.h>
+#include <stddef.h>
 
 double dlfunc_cos(double x)
 {
     return cos(x);
 }
 
+void dlfunc_cos_batch(const double *restrict xs, double *restrict ys, size_t n)
+{
+#pragma omp simd
+    for (size_t i = 0; i < n; i++)
+        ys[i] = cos(xs[i]);
+}
+
+void dlfunc_cosf_batch(const float *restrict xs, float *restrict ys, size_t n)
+{
+#pragma omp simd
+    for (size_t i = 0; i < n; i++)
+        ys[i] = cosf(xs[i]);
+}
@@ -0,0 +1,52 @@
+// gcc -O2 -ffast-math -fopenmp-simd ./dlfunc_gauss.c -lm -shared -o dlfunc_gauss.so
+// exp(-|x|^2) in any number of dimensions, for -m mc and -m sobol with -d.
+// Over [-a; a] in dim dimensions the integral is (sqrt(pi) * erf(a))^dim.
+// exp(-p * x^2) for --sweep: over [-a; a] it is sqrt(pi / p) * erf(a * sqrt(p))
+#include <math.h>
+#include <stddef.h>
+
+double dlfunc_gauss(double x)
+{
+    return exp(-x * x);
+}
+
+void dlfunc_gauss_batch(const double *restrict xs, double *restrict ys, size_t n)
+{
+#pragma omp simd
+    for (size_t i = 0; i < n; i++)
+        ys[i] = exp(-xs[i] * xs[i]);
+}
+
+double dlfunc_gauss_param(double x, double p)
+{
+    return exp(-p * x * x);
+}
+
+void dlfunc_gauss_param_batch(const double *restrict xs, double *restrict ys, size_t n,
+                              double p)
+{
+#pragma omp simd
+    for (size_t i = 0; i < n; i++)
+        ys[i] = exp(-p * xs[i] * xs[i]);
+}
+
+double dlfunc_gauss_nd(const double *x, unsigned dim)
+{
+    double r2 = 0;
+    for (unsigned d = 0; d < dim; d++)
+        r2 += x[d] * x[d];
+    return exp(-r2);
+}
+
+// point i is xs[i * dim .. (i + 1) * dim)
+void dlfunc_gauss_nd_batch(const double *restrict xs, double *restrict ys, size_t n,
+                           unsigned dim)
+{
+#pragma omp simd
+    for (size_t i = 0; i < n; i++) {
+        double r2 = 0;
+        for (unsigned d = 0; d < dim; d++)
+            r2 += xs[i * dim + d] * xs[i * dim + d];
+        ys[i] = exp(-r2);
+    }
+}
@@ -1,8 +1,34 @@
-// gcc -O2 ./dlfunc_sin.c -lm -shared -o dlfunc_sin.so
+// gcc -O2 -ffast-math -fopenmp-simd ./dlfunc_sin.c -lm -shared -o dlfunc_sin.so
+// -ffast-math together with -fopenmp-simd lets gcc call vector sin from libmvec
 #include <math.h>
+#include <stddef.h>
 
 double dlfunc_sin(double x)
 {
     return sin(x);
 }
 
+void dlfunc_sin_batch(const double *restrict xs, double *restrict ys, size_t n)
+{
+#pragma omp simd
+    for (size_t i = 0; i < n; i++)
+        ys[i] = sin(xs[i]);
+}
+
+// scalar variants of other precisions, used if there is no batched one
+float dlfunc_sinf(float x)
+{
+    return sinf(x);
+}
+
+long double dlfunc_sinl(long double x)
+{
+    return sinl(x);
+}
+
+void dlfunc_sinf_batch(const float *restrict xs, float *restrict ys, size_t n)
+{
+#pragma omp simd
+    for (size_t i = 0; i < n; i++)
+        ys[i] = sinf(xs[i]);
+}
@@ -0,0 +1,17 @@
+// gcc -O2 ./dlfunc_skewed.c -lm -shared -o dlfunc_skewed.so
+//
+// f(x) = x, but a hundred times more expensive to compute on [0.75; +inf).
+// Demonstrates load imbalance with a static split of the interval. Compare
+//     ./dlintegrate -v -t 4 -n 1e7 -c 2.5e6 -F skewed 0 1    (one chunk per thread)
+//     ./dlintegrate -v -t 4 -n 1e7 -F skewed 0 1             (work stealing)
+// With the static split the last thread does most of the work while the others idle.
+#include <math.h>
+
+double dlfunc_skewed(double x)
+{
+    int reps = (x < 0.75) ? 1 : 100;
+    // asin(sin(y)) == y for |y| <= pi/2, the compiler can not drop it
+    for (int i = 0; i < reps; i++)
+        x = asin(sin(x));
+    return x;
+}
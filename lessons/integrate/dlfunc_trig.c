@@ -0,0 +1,19 @@
+// gcc -O2 -ffast-math -fopenmp-simd ./dlfunc_trig.c -lm -shared -o dlfunc_trig.so
+// sin(x), cos(x) and sin(x) * cos(x) in a single pass, for -F trig.
+// Over [0; a] the integrals are 1 - cos(a), sin(a) and sin(a)^2 / 2
+#include <math.h>
+#include <stddef.h>
+
+const unsigned dlfunc_trig_nout = 3;
+
+// output o of point i is ys[o * n + i]
+void dlfunc_trig_multi(const double *restrict xs, double *restrict ys, size_t n)
+{
+#pragma omp simd
+    for (size_t i = 0; i < n; i++) {
+        double s = sin(xs[i]), c = cos(xs[i]);
+        ys[i] = s;
+        ys[n + i] = c;
+        ys[2 * n + i] = s * c;
+    }
+}
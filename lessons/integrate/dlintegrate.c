@@ -29,19 +29,46 @@
  *    Using POSIX threads requires -pthread flag
  * 5. Some simple logging techniques
  *    Build with -DDEBUG=1 if you need logging enabled
+ * 6. Plugins may additionally export a batched entry point which evaluates the function
+ *    over a whole array of points in one call. An indirect call per point prevents
+ *    the compiler from vectorizing anything, while a batched loop inside the plugin
+ *    can use SIMD math (e.g. libmvec). Old scalar-only plugins keep working.
+ * 7. Simple integrands do not need a plugin at all: -E takes an expression of x which
+ *    is compiled into bytecode for a block interpreter, see dlexpr.h
+ * 8. Multi-dimensional integrals are computed by Monte Carlo or quasi-Monte Carlo
+ *    (Sobol) sampling with -m mc|sobol -d dim, see integrate_sampling()
+ * 9. Results may be kept in a memory mapped file with -C, see cache_open()
+ * 10. All the integration is done by libintegrate (see libintegrate.h), so it can be
+ *    embedded into other programs. This file only parses options, reads jobs and
+ *    prints results
+ * 11. Functions may be tabulated into a sample file with -T, and sampled data
+ *    integrated with -S. Files are memory mapped, see integ_samples()
+ * 12. Plugins taking a parameter are integrated over a whole grid of its values at once
+ *    with --sweep, see integrate_sweep()
  * 
  */
 
-// gcc -DDEBUG=0 -O2 -fms-extensions -std=gnu18 integrate.c -lm -pthread -ldl -o ./int
+// gcc -O2 -ffast-math -fopenmp-simd -std=gnu18 -c dlexpr.c -o dlexpr.o
+// gcc -DDEBUG=0 -O2 -std=gnu18 -c libintegrate.c -o libintegrate.o
+// ar rcs libintegrate.a libintegrate.o dlexpr.o
+// gcc -DDEBUG=0 -O2 -fms-extensions -std=gnu18 dlintegrate.c libintegrate.a \
+//     -lm -pthread -ldl -o ./dlintegrate
 
 #define _GNU_SOURCE
-#include <dlfcn.h>              /* dynamic loading support           */
+#include "libintegrate.h"       /* the integration itself            */
+#include <errno.h>
+#include <getopt.h>             /* getopt_long() for --long options  */
 #include <float.h>              /* take float epsillon from here     */
 #include <libgen.h>             /* used for basename()               */
 #include <math.h>               /* used for floating point macrodefs */
 #include <pthread.h>            /* POSIX threading                   */
+#include <sched.h>              /* CPU sets for thread affinity      */
+#include <signal.h>             /* daemon shutdown on SIGINT/SIGTERM */
 #include <sysexits.h>           /* we want some exit codes from it   */
+#include <sys/socket.h>         /* daemon mode: Unix domain sockets  */
+#include <sys/stat.h>           /* lstat() of the socket path        */
 #include <sys/sysinfo.h>        /* get nproc as reported by sysinfo  */
+#include <sys/un.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -49,9 +76,6 @@
 #include <time.h>               /* timing-related stuff is here      */
 #include <unistd.h>             /* getopt() resides here             */
 
-// this is for our function to load
-#define FUNC_PREFIX "dlfunc_"
-
 // Simple logging facility
 // When compiled with -DDEBUG=1, the logging will appear on stderr
 #if defined(DEBUG) && DEBUG
@@ -70,51 +94,18 @@
         cond;                                      \
     }
 
-// Change this type to float, double, long double and see how the consumed time
-// changes and don't forget to change sin to sinf or sinl
+// Arguments and results are passed to libintegrate as double, the hot loop
+// may run in another precision (see -p)
 typedef double farg_t;
-typedef farg_t (*funcptr_t)(farg_t);
 
 static const farg_t EPSILON = FLT_EPSILON;
+// Significant digits printed for results. Higher order rules are accurate
+// far beyond the default 6 digits of %g
+#define RESULT_DIGITS DBL_DIG
 
-// We want all our errrors structured and will use this for handsome
-// error messages declaration below.
-//
-// Enum is implemented as arbitrary integer type (picked by the compiler),
-// But we may want to pin-point compiler which type to pick, e.g.:
-//     PE_OK = (unsigned char) 0
+// We want all our errrors structured, see enum error in libintegrate.h and
+// integ_strerror() for handsome messages.
 //
-// The first error code means no error here and is given as 0 explicitly
-// so the following ones will have numbers 1, 2, ...
-enum error {
-    PE_OK = 0,          /* No error                                        */
-    PE_NOARGS,          /* No arguments provided                           */
-    PE_WRONGARG,        /* Argument has wrong format                       */
-    PE_NENARGS,         /* Not enough arguments                            */
-    PE_TMARGS,          /* Too much arguments                              */
-    PE_CVGERR,          /* Convergence error                               */
-    PE_MALLOC,          /* Memory allocation error                         */
-    PE_THREAD,          /* Threading error                                 */
-    PE_DLERR,           /* Dynamic loader error                            */
-    __PE_LAST           /* Last item. So that array sizes match everywhere */
-};
-
-
-// And here we rely on designated init GCC extension
-static const char *const error_msg[] = {
-    [PE_OK]       = "",
-    [PE_NOARGS]   = "No arguments provided",
-    [PE_WRONGARG] = "Wrong argument '%s'",
-    [PE_NENARGS]  = "Not enough arguments",
-    [PE_TMARGS]   = "Too many arguments",
-    [PE_CVGERR]   = "Convergence unreachable",
-    [PE_MALLOC]   = "Could not allocate memory",
-    [PE_THREAD]   = "Threading error",
-    [PE_DLERR]    = "Dynamic loader (%s)",
-    [__PE_LAST]   = NULL
-};
-
-
 // And we want useful error codes returned
 // We could assign these error codes to enum values directly
 // but that would have been a waste of space. And also would
@@ -129,34 +120,72 @@ static const int error_retcodes[] = {
     [PE_MALLOC]   = EX_OSERR,         /* sysexits.h: internal OS error        */
     [PE_THREAD]   = EX_OSERR,
     [PE_DLERR]    = EX_SOFTWARE,      /* sysexits.h: internal software error  */
+    [PE_SOCKET]   = EX_OSERR,
+    [PE_CACHE]    = EX_IOERR,         /* sysexits.h: input/output error       */
+    [PE_SAMPLES]  = EX_IOERR,
+    [PE_JOBS]     = EX_DATAERR,
     [__PE_LAST]   = EXIT_FAILURE
 };
 
 
+// -m takes a rule name (see integ_rule()), romberg or one of the samplers
+static const char *const sampling_names[] = {
+    [SAMPLING_GRID]   = "grid",
+    [SAMPLING_MC]     = "mc",
+    [SAMPLING_SOBOL]  = "sobol",
+    [__SAMPLING_LAST] = NULL
+};
+
+static const char *const precision_names[] = {
+    [PREC_DOUBLE] = "double",
+    [PREC_FLOAT]  = "float",
+    [PREC_LDOUBLE] = "ldouble",
+    [__PREC_LAST] = NULL
+};
+
+
 // Example of how defaults or other behavior defining stuff could be
 // well structured.
 // "Namespaces are one honking great idea -- let's do more of those!"
 // So, it is better and cleaner than having tons of stuff here and there.
 // Another alternative is using global enums
 struct defaults {
-    long long nsteps;
     long long nthreads;
+    long long nreps;         // measured runs of the same integral
+    long long nwarmups;      // unmeasured runs before them
 };
 
 static const struct defaults DEFAULTS = {
-    .nsteps = 10e6,
-    .nthreads = 1
+    .nthreads = 1,
+    .nreps = 1,
+    .nwarmups = 0
 };
 
+// and those of the integration itself are given by the library
+static const struct integ_params PARAMS_DEFAULTS = INTEG_PARAMS_DEFAULT;
+
 
 // Here we will store arguments after parsing
 struct args {
     struct defaults;    // DRY
-    farg_t start;
-    farg_t end;
+    // Integration parameters are both embedded, so that args.nsteps works, and
+    // named, so that args.params can be handed to the library as a whole
+    union {
+        struct integ_params;
+        struct integ_params params;
+    };
     const char *funcname;
+    const char *expression;    // used instead of a plugin when set
+    const char *jobfile;    // batch mode when set
+    const char *sockname;   // daemon mode when set
+    const char *affinity;   // workers are pinned to CPUs when set
+    const char *cachefile;  // results are cached when set
+    const char *tabfile;    // the function is tabulated into it when set
+    const char *samplefile; // integrated instead of a function when set
+    long long cacheslots;   // 0 keeps the size of an existing cache
     unsigned int isverbose : 1;
     unsigned int ishelp : 1;
+    unsigned int isstats : 1;
 };
 
 
@@ -169,8 +198,25 @@ struct args {
 // Notice how we're using POSIX format extension here:
 // %1$s prints first argument as string. This allows to provide an argument only once
 static const char *const USAGE = (
-    "Integrate user function using the left squares method.\n\n"
-    "Usage: %s [-v] [-t threads] [-n steps] -F funcname start end\n"
+    "Integrate user function using one of fixed step quadrature rules"
+    " or adaptive Gauss-Kronrod quadrature.\n\n"
+    "Usage: %s [-v] [-t threads] [-n steps] [-m method] [-p precision] [-c chunk]"
+    " [-e tolerance] [-r reps] [-w warmups] [-a affinity] [-C cachefile"
+    " [--cache-size entries]] [--stats]"
+    " -F funcname start end\n"
+    "       %1$s [-v] [-t threads] [-n steps] [-m method] [-c chunk] [-r reps] [-w warmups]"
+    " --sweep p0:p1:count -F funcname start end\n"
+    "       %1$s [options as above] -E expression start end\n"
+    "       %1$s [options as above] -m mc|sobol [-d dim] [-s seed] -F funcname"
+    " start end | start1 end1 ... startdim enddim\n"
+    "       %1$s [-v] [-t threads] [-n steps] [-c chunk] [-r reps] [-w warmups]"
+    " -T file -F funcname | -E expression start end\n"
+    "       %1$s [-v] [-t threads] [-m left|trapezoid|simpson] [-c chunk] [-r reps]"
+    " [-w warmups] [-C cachefile] -S file\n"
+    "       %1$s [-v] [-t threads] [-n steps] [-m method] [-p precision] [-c chunk]"
+    " [-e tolerance] -b jobfile\n"
+    "       %1$s [-v] [-t threads] [-n steps] [-m method] [-p precision] [-c chunk]"
+    " [-e tolerance] -D socket\n"
     "Try '%1$s -h' for more information\n"
     /* Of course the previous line will end up appearing in -h help -- it is an example */
 );
@@ -181,14 +227,130 @@ static const char *const HELP = (
     "\n*  The program dynamically loads function " FUNC_PREFIX "funcname given"
     " as -F funcname argument from the " FUNC_PREFIX "funcname.so shared"
     " library and integrates it.\n"
+    "*  -E argument if provided is integrated instead of a library function. It is"
+    " an expression of x like 'exp(-x*x)*cos(3*x)' with + - * / ^, parentheses,"
+    " constants pi and e, functions sin cos tan asin acos atan sinh cosh tanh exp"
+    " log log10 sqrt cbrt abs floor ceil and pow atan2 min max of two arguments."
+    " It is compiled once and evaluated over blocks of points with SIMD math,"
+    " in both precisions.\n"
     "*  -v argument if provided results in verbose output with measured"
     " exec time.\n"
     "*  -t argument if provided specifies number of threads (%lld thread%s is"
     " used by default). If given as -t 0, the number of threads will"
-    " be automatically picked as the number of CPUs available on the"
-    " system, as reported by nproc.\n"
+    " be automatically picked as the number of CPUs the process may run on"
+    " (as reported by nproc, which respects cpusets and taskset), or as the"
+    " number of CPUs in the -a list.\n"
+    "*  -a argument if provided pins threads to CPUs. With -a cores threads go one"
+    " per physical core first and only then to SMT siblings, as read from"
+    " /sys/devices/system/cpu/cpuN/topology. Otherwise it is a list of CPUs like"
+    " 0-3,8,10 used in the given order. Threads wrap around if there are more of"
+    " them than CPUs. Only CPUs allowed for the process can be used. -v reports"
+    " the placement.\n"
     "*  -n argument if provided specifies number of integration steps"
     " (%lld steps is used by default)\n"
+    "*  -m argument if provided selects the rule applied to every step: left (left"
+    " rectangles, default), midpoint, trapezoid, simpson or gaussN (N points"
+    " Gauss-Legendre, N = 2..5). Higher order rules need a lot less steps for the same"
+    " accuracy, each step costs as many evaluations as the rule has distinct nodes.\n"
+    "*  -m mc or -m sobol selects Monte Carlo integration over a box: -n points are"
+    " sampled pseudo-randomly (xoshiro256**) or from the Sobol sequence, and -v"
+    " reports the standard error as the error estimate. For Sobol it is estimated"
+    " from %d independent random digital shifts of the sequence, each taking the"
+    " same share of points. Points come in blocks of %d with a generator seeded by"
+    " the block number and -s seed, and block sums are added in order, so the result"
+    " only depends on the seed and not on the number of threads.\n"
+    "*  -d argument if provided sets the number of dimensions (1..%d) and selects -m mc"
+    " unless -m sobol is given. The box is given by start end pairs for every axis,"
+    " or a single pair for all of them. The library has to export "
+    FUNC_PREFIX "funcname" ND_SUFFIX "(const double *x, unsigned dim), and optionally "
+    FUNC_PREFIX "funcname" ND_SUFFIX BATCH_SUFFIX "(const double *xs, double *ys,"
+    " size_t n, unsigned dim) taking n points of dim coordinates one after another."
+    " One-dimensional functions work with -m mc and -m sobol as well.\n"
+    "*  -p argument if provided selects precision of the fixed step methods: double"
+    " (default), float or ldouble. Float doubles the SIMD width if the library exports "
+    FUNC_PREFIX "funcname" "f" BATCH_SUFFIX "(const float *xs, float *ys, size_t n)."
+    " Ldouble computes points and sums in long double, which is slow (no SIMD) but"
+    " keeps the rounding error out of the result, still printed as double. Each"
+    " precision uses its batched entry point, then the scalar " FUNC_PREFIX "funcname"
+    "f(float) or " FUNC_PREFIX "funcname" "l(long double) one, like sinf() and sinl()"
+    " of libm (" FUNC_PREFIX "funcname" "l" BATCH_SUFFIX " is batched long double),"
+    " and otherwise points are converted to double for the plugin. Sample points are"
+    " computed from their index and sums are compensated, so the rounding error does"
+    " not grow with the number of steps: it stays within a few FLT_EPSILON relative"
+    " to the integral of |f| + |x f'| for float, on top of the method error.\n"
+    "*  -c argument if provided specifies number of steps in a chunk. Chunks are"
+    " distributed among threads with work stealing: an idle thread takes a half of"
+    " the remaining chunks of a busy one. By default the size is picked so there are"
+    " at most %d chunks. Use -c steps/threads to get a static equal split.\n"
+    "*  -e argument if provided switches to adaptive 7-15 points Gauss-Kronrod"
+    " quadrature. Intervals with the worst error estimate are bisected until"
+    " the total estimate drops below the given absolute tolerance."
+    " With -v the achieved estimate and number of evaluations are reported.\n"
+    "*  -m romberg selects progressive Romberg integration: the number of steps"
+    " is doubled, reusing all points computed before, until Richardson extrapolated"
+    " estimates of two levels agree within -e tolerance (or in about 13 digits if"
+    " -e is not given). -n caps the number of steps, and --budget seconds stops it"
+    " before a level which would not fit into the time. The estimate of every"
+    " level is printed with -v.\n"
+    "*  If the library also exports " FUNC_PREFIX "funcname" BATCH_SUFFIX "(const double *xs,"
+    " double *ys, size_t n), it is preferred over the scalar function.\n"
+    "*  -F argument may be a comma separated list of up to %d functions. They are"
+    " integrated by fixed step rules in a single pass: every block of points is"
+    " generated once and evaluated by all functions while it is in cache, and the"
+    " threads are shared. Results are printed one per line in the given order. A"
+    " library may export a fused " FUNC_PREFIX "funcname" MULTI_SUFFIX "(const double"
+    " *xs, double *ys, size_t n) computing several functions at once (output o of"
+    " point i goes to ys[o * n + i]) together with const unsigned " FUNC_PREFIX
+    "funcname" NOUT_SUFFIX " giving their number. It counts as that many"
+    " functions, and is only used this way.\n"
+    "*  -r and -w arguments if provided repeat the integration reps times after"
+    " warmups unmeasured runs, with the same threads and loaded library. The time"
+    " reported by -v is the median then, and its 95th percentile is reported too."
+    " Time of loading the library and starting threads is reported separately."
+    " See bench.sh for a benchmark built on this.\n"
+    "*  -C argument if provided keeps results in the given file, so integrals which"
+    " have been computed before (by any process using the file) are not computed"
+    " again. The key is a hash of the library contents (or the expression) and of"
+    " all options which affect the result, so a rebuilt library never gets stale"
+    " results. -v reports hits and misses. The file holds --cache-size entries"
+    " (%d by default, or as many as the existing file has), %d bytes each; when"
+    " it is full the least recently used results are replaced. A file of another"
+    " size is cleared.\n"
+    "*  -T argument if provided writes samples of the function to the given file"
+    " instead of integrating it: its values at -n steps + 1 equally spaced points of"
+    " [start; end], both ends included. Threads evaluate the function right into the"
+    " file mapped into memory, and every chunk is flushed and released as soon as it"
+    " is done, so the file may be larger than RAM.\n"
+    "*  -S argument if provided integrates samples from the given file (written by -T,"
+    " or measured data, see libintegrate.h for the format) with -m left, trapezoid"
+    " (default) or simpson. An odd number of steps gets the Simpson 3/8 rule on the"
+    " last three. The interval and steps come from the file. It is mapped into memory"
+    " and added up by all threads in chunks where it is, without copying, and pages are"
+    " released after every chunk, so resident memory stays within a chunk per thread"
+    " however large the file is. Results are cached (-C) until the file is modified.\n"
+    "*  --sweep argument if provided integrates the function for count values of its"
+    " parameter p0 + k * (p1 - p0) / (count - 1), k = 0 .. count - 1, and prints the"
+    " integrals one per line in this order. The plugin exports double " FUNC_PREFIX
+    "funcname" PARAM_SUFFIX "(double x, double p), and optionally a batched"
+    " " FUNC_PREFIX "funcname" PARAM_SUFFIX BATCH_SUFFIX "(const double *xs,"
+    " double *ys, size_t n, double p). All the integrals are computed in a single"
+    " pass split into chunks over both the parameter and x, so a few large ones are"
+    " balanced as well as many small ones. Fixed step methods in double only.\n"
+    "*  --stats if provided reports evaluations, wall and CPU time of every thread"
+    " and the load imbalance (maximum over mean), summed over all runs. Cycles and"
+    " instructions are reported too if perf_event_open is permitted"
+    " (see /proc/sys/kernel/perf_event_paranoid).\n"
+    "*  -b argument if provided switches to batch mode: integrals are read from"
+    " the given file ('-' for stdin), one per line as"
+    " 'funcname start end [steps [method]]', and results (or 'error: message' for"
+    " failed jobs) are printed one per line in the same order. Empty lines and"
+    " lines starting with '#' are skipped. Options given on the command line are"
+    " defaults for every job. Libraries and threads are loaded and started once"
+    " for all of them.\n"
+    "*  -D argument if provided runs a daemon listening on the given Unix domain"
+    " socket. Clients send job lines in the same format as for -b and get one result"
+    " line (or 'error: message') per job. Requests of all clients share the same"
+    " threads, so -t caps CPU usage of the daemon. SIGINT or SIGTERM stops it.\n"
     "*  start and stop arguments are required positionals specifing the"
     " integration interval as [start; stop]\n"
 );
@@ -201,24 +363,28 @@ static void err_handler(enum error err, void *etc)
     // could allow for good code reuse without namespace collisions
     void report(const char *msg)
     {
-        fprintf(stderr, "Error: %s.\n", msg ?: error_msg[err]);
+        fprintf(stderr, "Error: %s.\n", msg ?: integ_strerror(err));
         exit(error_retcodes[err]);
     }
 
     switch (err) {
     case PE_OK:
         break;
-    case PE_WRONGARG: ;
+    case PE_WRONGARG:
+    case PE_SOCKET:
+    case PE_CACHE:
+    case PE_SAMPLES:
+    case PE_JOBS: ;
         char *optarg = etc;
         char *errstr;    // this one is allocated
-        asprintf(&errstr, error_msg[err], optarg);
+        asprintf(&errstr, integ_strerror(err), optarg);
         report(errstr);
         // free(errstr);  -- not needed as exit is near
         break;
     case PE_DLERR: ;
         char *dlerrstr;
-        // dlerror() provides its own error string containing err info
-        asprintf(&dlerrstr, error_msg[err], dlerror());
+        // the library keeps the dlerror() string, see integ_errdetail()
+        asprintf(&dlerrstr, integ_strerror(err), etc ?: integ_errdetail());
         report(dlerrstr);
         break;
     case PE_NOARGS: ;
@@ -238,9 +404,119 @@ static inline bool ld_conv(const char *str, long double *dstptr)
 }
 
 
-static long long diff_us(struct timespec t1, struct timespec t2)
+static long long diff_ns(struct timespec t1, struct timespec t2)
 {
-    return (long long)(t2.tv_sec - t1.tv_sec) * 1000000LL + (t2.tv_nsec - t1.tv_nsec) / 1000;
+    return (long long)(t2.tv_sec - t1.tv_sec) * 1000000000LL + (t2.tv_nsec - t1.tv_nsec);
+}
+
+
+static int cmp_ll(const void *a, const void *b)
+{
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+
+
+// CPU placement.
+// The process may be restricted to a subset of CPUs (cpuset, taskset), so the
+// allowed mask is the starting point rather than all CPUs of the system
+
+struct cpu_topology {
+    int package;
+    int core;
+};
+
+static struct cpu_topology cpu_topology(int cpu)
+{
+    // every CPU is a core of its own if sysfs does not tell otherwise
+    struct cpu_topology topo = { .package = 0, .core = cpu };
+    const char *const files[] = { "physical_package_id", "core_id" };
+    int *const fields[] = { &topo.package, &topo.core };
+
+    for (int i = 0; i < 2; i++) {
+        char path[128];
+        snprintf(path, sizeof path, "/sys/devices/system/cpu/cpu%d/topology/%s", cpu, files[i]);
+        FILE *file = fopen(path, "r");
+        if (NULL == file)
+            continue;
+        if (1 != fscanf(file, "%d", fields[i]))
+            *fields[i] = (1 == i) ? cpu : 0;
+        fclose(file);
+    }
+    return topo;
+}
+
+// Fill cpus (if not NULL) with CPUs for workers in placement order, see HELP for spec.
+// NULL spec gives all allowed CPUs. Returns the number of CPUs or -1 if spec is wrong
+static int affinity_cpus(const char *spec, int *cpus)
+{
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof allowed, &allowed))
+        return (NULL == spec) ? get_nprocs() : -1;
+
+    int list[CPU_SETSIZE], n = 0;
+
+    if ((NULL == spec) || !strcmp(spec, "cores")) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &allowed))
+                list[n++] = cpu;
+        }
+    } else {
+        // list like 0-3,8,10
+        for (const char *cur = spec; *cur;) {
+            int first, last, len;
+            if (2 == sscanf(cur, "%d-%d%n", &first, &last, &len))
+                ;
+            else if (1 == sscanf(cur, "%d%n", &first, &len))
+                last = first;
+            else
+                return -1;
+            cur += len;
+            if (',' == *cur)
+                cur++;
+            else if (*cur)
+                return -1;
+
+            for (int cpu = first; cpu <= last; cpu++) {
+                if ((cpu < 0) || (cpu >= CPU_SETSIZE) || !CPU_ISSET(cpu, &allowed) ||
+                    (n == CPU_SETSIZE))
+                    return -1;
+                list[n++] = cpu;
+            }
+        }
+    }
+
+    if ((NULL != spec) && !strcmp(spec, "cores")) {
+        // first CPU of every physical core goes first, then SMT siblings
+        struct cpu_topology topo[CPU_SETSIZE];
+        bool istaken[CPU_SETSIZE] = { false };
+        int ordered[CPU_SETSIZE], nordered = 0;
+
+        for (int i = 0; i < n; i++)
+            topo[i] = cpu_topology(list[i]);
+
+        for (int i = 0; i < n; i++) {
+            bool isnewcore = true;
+            for (int k = 0; (k < i) && isnewcore; k++) {
+                isnewcore = !istaken[k] || (topo[k].package != topo[i].package) ||
+                            (topo[k].core != topo[i].core);
+            }
+            if (isnewcore) {
+                ordered[nordered++] = list[i];
+                istaken[i] = true;
+            }
+        }
+        for (int i = 0; i < n; i++) {
+            if (!istaken[i])
+                ordered[nordered++] = list[i];
+        }
+        memcpy(list, ordered, n * sizeof *list);
+    }
+
+    if (NULL != cpus)
+        memcpy(cpus, list, n * sizeof *list);
+    return n;
 }
 
 
@@ -249,23 +525,37 @@ static struct args parse_args(int argc, char *argv[])
     int _opterr = opterr;
     opterr = 0;
     // 'struct args' is not the same as 'args'
-    struct args args = { DEFAULTS, .funcname = NULL };
+    struct args args = { DEFAULTS, { INTEG_PARAMS_DEFAULT }, .funcname = NULL };
 
     log("Init args:"
         "\n\tnsteps: %lld,\n\tnthreads: %lld,\n\tstart: %Lg,\n\tstop: %Lg,"
-        "\n\tfuncname: '%s',\n\tisverbose: %c,\n\tishelp: %c",
+        "\n\ttolerance: %Lg,\n\tfuncname: '%s',\n\tisverbose: %c,\n\tishelp: %c",
         (long long)args.nsteps, (long long)args.nthreads, (long double)args.start,
-        (long double)args.end, args.funcname, args.isverbose ? 'T' : 'F',    // notice how
-        args.ishelp ? 'T' : 'F');                                            // it is converted
+        (long double)args.end, (long double)args.tolerance, args.funcname,
+        args.isverbose ? 'T' : 'F', args.ishelp ? 'T' : 'F');    // notice how it is converted
+
+    // Long options are a GNU extension of getopt. Those without a short equivalent
+    // get codes outside of the char range
+    enum { OPT_STATS = 256, OPT_CACHE_SIZE, OPT_BUDGET, OPT_SWEEP };
+    static const struct option long_options[] = {
+        { "budget", required_argument, NULL, OPT_BUDGET },
+        { "sweep", required_argument, NULL, OPT_SWEEP },
+        { "stats", no_argument, NULL, OPT_STATS },
+        { "cache-size", required_argument, NULL, OPT_CACHE_SIZE },
+        { 0 }
+    };
 
     // Why not while? Not critical, but an example of keeping scope ns clean
-    for (int sym; (sym = getopt(argc, argv, "hvt:n:F:")) != -1;) {
+    const char *method = NULL;    // -m argument, for error messages
+    for (int sym; (sym = getopt_long(argc, argv, "hvt:n:m:d:s:p:c:e:r:w:a:C:b:D:F:E:T:S:",
+                                     long_options, NULL)) != -1;) {
         switch (sym) {
         case 'h': /* help: print message and exit peacefully */
             args.ishelp = true;    // just to show
             fprintf(stderr, USAGE, argv[0]);
             fprintf(stderr, HELP, DEFAULTS.nthreads, DEFAULTS.nthreads > 1 ? "s" : "",
-                    DEFAULTS.nsteps);
+                    PARAMS_DEFAULTS.nsteps, SOBOL_REPLICAS, MC_BLOCK, MC_MAX_DIM, MAX_AUTO_CHUNKS,
+                    MAX_FUSED, CACHE_DEFAULT_SLOTS, CACHE_SLOT_SIZE);
             exit(error_retcodes[PE_OK]);
         case 'v':
             args.isverbose = true;
@@ -282,6 +572,112 @@ static struct args parse_args(int argc, char *argv[])
                 err_handler(PE_WRONGARG, optarg);
             args.nsteps = steps;
             break;
+        case 'm':
+            method = optarg;
+            args.sampling = __SAMPLING_LAST;
+            for (int i = SAMPLING_GRID + 1; i < __SAMPLING_LAST; i++) {
+                if (!strcmp(optarg, sampling_names[i]))
+                    args.sampling = i;
+            }
+            if (__SAMPLING_LAST != args.sampling)
+                break;
+            args.sampling = SAMPLING_GRID;
+            args.isromberg = !strcmp(optarg, "romberg");
+            if (args.isromberg)
+                break;
+            args.rule = integ_rule(optarg);
+            if (NULL == args.rule)
+                err_handler(PE_WRONGARG, optarg);
+            break;
+        case 'd':;
+            long double dim;
+            if (!ld_conv(optarg, &dim) || (dim < 1) || (dim > MC_MAX_DIM))
+                err_handler(PE_WRONGARG, optarg);
+            args.ndim = dim;
+            break;
+        case 's':;
+            char *seedend;
+            errno = 0;
+            args.seed = strtoull(optarg, &seedend, 0);
+            if (*seedend || errno)
+                err_handler(PE_WRONGARG, optarg);
+            break;
+        case 'p':
+            args.precision = __PREC_LAST;
+            for (int i = 0; i < __PREC_LAST; i++) {
+                if (!strcmp(optarg, precision_names[i]))
+                    args.precision = i;
+            }
+            if (__PREC_LAST == args.precision)
+                err_handler(PE_WRONGARG, optarg);
+            break;
+        case 'c':;
+            long double chunk;
+            if (!ld_conv(optarg, &chunk) || ((long long)chunk <= 0))
+                err_handler(PE_WRONGARG, optarg);
+            args.chunksteps = chunk;
+            break;
+        case 'e':;
+            long double tolerance;
+            if (!ld_conv(optarg, &tolerance) || (tolerance <= 0))
+                err_handler(PE_WRONGARG, optarg);
+            args.tolerance = tolerance;
+            break;
+        case 'r':;
+            long double reps;
+            if (!ld_conv(optarg, &reps) || ((long long)reps <= 0))
+                err_handler(PE_WRONGARG, optarg);
+            args.nreps = reps;
+            break;
+        case 'w':;
+            long double warmups;
+            if (!ld_conv(optarg, &warmups) || ((long long)warmups < 0))
+                err_handler(PE_WRONGARG, optarg);
+            args.nwarmups = warmups;
+            break;
+        case 'a':
+            if (affinity_cpus(optarg, NULL) <= 0)
+                err_handler(PE_WRONGARG, optarg);
+            args.affinity = optarg;
+            break;
+        case OPT_STATS:
+            args.isstats = true;
+            break;
+        case OPT_BUDGET:;
+            long double budget;
+            if (!ld_conv(optarg, &budget) || (budget <= 0))
+                err_handler(PE_WRONGARG, optarg);
+            args.budget = budget;
+            break;
+        case OPT_SWEEP:;
+            // p0:p1:count
+            char *sweep = strdupa(optarg), *saveptr;
+            const char *fields[3] = { strtok_r(sweep, ":", &saveptr) };
+            fields[1] = fields[0] ? strtok_r(NULL, ":", &saveptr) : NULL;
+            fields[2] = fields[1] ? strtok_r(NULL, ":", &saveptr) : NULL;
+            long double p0, p1, count;
+            if (!fields[2] || strtok_r(NULL, ":", &saveptr) || !ld_conv(fields[0], &p0) ||
+                !ld_conv(fields[1], &p1) || !ld_conv(fields[2], &count) || (count < 1))
+                err_handler(PE_WRONGARG, optarg);
+            args.param = p0;
+            args.paramend = p1;
+            args.nparams = count;
+            break;
+        case 'C':
+            args.cachefile = optarg;
+            break;
+        case OPT_CACHE_SIZE:;
+            long double slots;
+            if (!ld_conv(optarg, &slots) || ((long long)slots <= 0))
+                err_handler(PE_WRONGARG, optarg);
+            args.cacheslots = slots;
+            break;
+        case 'b':
+            args.jobfile = optarg;
+            break;
+        case 'D':
+            args.sockname = optarg;
+            break;
         case 'F': /* func: sets function name */
             // optarg is available globally
             // here we don't need to allocate as getopt
@@ -289,6 +685,15 @@ static struct args parse_args(int argc, char *argv[])
             // what is already in memory
             args.funcname = optarg;
             break;
+        case 'E':
+            args.expression = optarg;
+            break;
+        case 'T':
+            args.tabfile = optarg;
+            break;
+        case 'S':
+            args.samplefile = optarg;
+            break;
         case '?': /* this character indicates an error */
             /* fall through */
         default:
@@ -302,75 +707,453 @@ static struct args parse_args(int argc, char *argv[])
 
     log("optind value after parsing: %d", optind);
 
-    if ((NULL == args.funcname) || (argc - optind < 2))
+    // some additional steps -- fill in npoc autodetection if nthreads is 0
+    // get_nprocs() would count CPUs this process is not allowed to use
+    args.nthreads = args.nthreads ?: affinity_cpus(args.affinity, NULL);
+
+    // only points can be sampled in many dimensions, not a grid
+    if ((args.ndim > 1) && (SAMPLING_GRID == args.sampling))
+        args.sampling = SAMPLING_MC;
+
+    // Romberg reports every level
+    args.trace = args.isverbose ? stderr : NULL;
+
+    // jobs come from the file or clients, positionals are not expected
+    bool isfile = (NULL != args.tabfile) || (NULL != args.samplefile);
+    if ((NULL != args.jobfile) || (NULL != args.sockname)) {
+        if ((argc - optind > 0) || isfile || (args.nparams > 0))
+            err_handler(PE_TMARGS, NULL);
+        return args;
+    }
+
+    // and so is a function for samples, which are on a grid of their own with a few
+    // rules fitting it
+    if (NULL != args.samplefile) {
+        if ((argc - optind > 0) || (NULL != args.funcname) || (NULL != args.expression) ||
+            (NULL != args.tabfile))
+            err_handler(PE_TMARGS, NULL);
+        args.rule = args.rule ?: integ_rule("trapezoid");
+        bool isrule = (integ_rule("left") == args.rule) ||
+                      (integ_rule("trapezoid") == args.rule) ||
+                      (integ_rule("simpson") == args.rule);
+        if (args.tolerance > 0)
+            err_handler(PE_WRONGARG, "-e");
+        if (args.ndim > 1)
+            err_handler(PE_WRONGARG, "-d");
+        if (!isrule || args.isromberg || (SAMPLING_GRID != args.sampling))
+            err_handler(PE_WRONGARG, (char *)method);
+        return args;
+    }
+
+    if (((NULL == args.funcname) && (NULL == args.expression)) || (argc - optind < 2))
         err_handler(PE_NENARGS, NULL);    // not enough args
 
-    if (argc - optind > 2)
+    // either a single interval or one per axis
+    int nbounds = argc - optind;
+    if (((nbounds != 2) && (nbounds != 2 * args.ndim)) ||
+        ((NULL != args.funcname) && (NULL != args.expression)))
         err_handler(PE_TMARGS, NULL);    // too much args
+    if ((args.ndim > 1) && (NULL != args.expression))
+        err_handler(PE_WRONGARG, (char *)args.expression);    // only x is there
+    if ((args.ndim > 1) && (NULL != args.tabfile))
+        err_handler(PE_WRONGARG, "-d");    // samples are one-dimensional
+    if ((args.nparams > 0) && ((NULL != args.expression) || (NULL != args.tabfile)))
+        err_handler(PE_TMARGS, NULL);      // neither has a parameter
 
     // now we're sure on number of positional arguments -- consume them
     // again, this is not needed with more feature-rich parsers like Argp
-    long double start, end;
-    if (!ld_conv(argv[optind], &start) || !ld_conv(argv[++optind], &end)) {
-        err_handler(PE_WRONGARG, argv[optind]);
-    }
-
-    if ((end - start) <= EPSILON) {
-        fprintf(stderr, "Can not left-integrate from %Lg to %Lg\n", start, end);
-        err_handler(PE_CVGERR, NULL);
+    static farg_t box[2 * MC_MAX_DIM];
+    for (int i = 0; i < nbounds; i += 2, optind += 2) {
+        long double start, end;
+        if (!ld_conv(argv[optind], &start) || !ld_conv(argv[optind + 1], &end))
+            err_handler(PE_WRONGARG, argv[optind]);
+
+        if ((end - start) <= EPSILON) {
+            fprintf(stderr, "Can not integrate from %Lg to %Lg\n", start, end);
+            err_handler(PE_CVGERR, NULL);
+        }
+        box[i] = start;
+        box[i + 1] = end;
     }
 
-    args.start = start;
-    args.end = end;
-
-    // some additional steps -- fill in npoc autodetection if nthreads is 0
-    // this could be also done with pthread procedures
-    args.nthreads = args.nthreads ?: get_nprocs();
+    args.start = box[0];
+    args.end = box[1];
+    if (nbounds > 2)
+        args.box = box;
 
     log("Parsed args:"
         "\n\tnsteps: %lld,\n\tnthreads: %lld,\n\tstart: %Lg,\n\tstop: %Lg,"
-        "\n\tfuncname: '%s',\n\tisverbose: %c,\n\tishelp: %c",
+        "\n\ttolerance: %Lg,\n\tfuncname: '%s',\n\tisverbose: %c,\n\tishelp: %c",
         (long long)args.nsteps, (long long)args.nthreads, (long double)args.start,
-        (long double)args.end, args.funcname,
+        (long double)args.end, (long double)args.tolerance, args.funcname,
         args.isverbose ? 'T' : 'F', args.ishelp ? 'T' : 'F');
 
     return args;
 }
 
 
-struct thread_args {
-    farg_t start;
-    farg_t end;
-    farg_t step;
-    funcptr_t funcptr;
-    volatile farg_t *resptr;
+// Batch mode.
+// Jobs are read in windows of BATCH_WINDOW lines. The whole window is parsed first
+// and then submitted at once, so the library gets all of its jobs together and
+// computes small ones one job per worker (see libintegrate.h). Then results of the
+// window are printed in the input order.
+// Every job gets a line, its result or 'error: message' the same as the daemon
+// answers, and a failed job does not stop the others. Only failures to allocate
+// or to start threads, which would fail every following job as well, end the run
+#define BATCH_WINDOW 4096
+
+struct batch_job {
+    struct args args;    // defaults from the command line overridden by the job line
+    const struct integrand *func;
+    struct integ_job *job;
+    enum error err;
+    char *errline;       // 'error: ...' if the job has failed
 };
 
-static void *integrate_worker(void *argsptr)
+// 'error: message' line for a failed job, allocated. Loader details are kept per
+// thread, so this is to be called right after the failure
+static char *job_errline(enum error err, const char *line)
+{
+    const char *dlerr = (PE_DLERR == err) ? integ_errdetail() : NULL;
+    char *msg = NULL, *errline = NULL;
+    if (asprintf(&msg, integ_strerror(err), dlerr ?: line ?: "") < 0)
+        return NULL;
+    if (asprintf(&errline, "error: %s\n", msg) < 0)
+        errline = NULL;
+    free(msg);
+    return errline;
+}
+
+static inline bool isfatal(enum error err)
 {
-    // convert passed arguments back since we know what they are
-    // we passed them during thread creation
-    struct thread_args *args = argsptr;
-    funcptr_t func = args->funcptr;
-    farg_t start = args->start, end = args->end, step = args->step;
-
-    log("Thread started with args: %Lg %Lg %Lg",
-        (long double)start, (long double)end, (long double)step);
-
-    farg_t res = .0;
-    while (start < end) {
-        res += func(start) * step;
-        start += step;
+    return (PE_MALLOC == err) || (PE_THREAD == err);
+}
+
+// Parse 'funcname start end [steps [method]]'. Line is modified
+static bool parse_job(char *line, struct integ_ctx *ctx, struct batch_job *job, enum error *err)
+{
+    char *fields[5], *saveptr;
+    int nfields = 0;
+    for (char *tok = strtok_r(line, " \t\n", &saveptr); NULL != tok;
+         tok = strtok_r(NULL, " \t\n", &saveptr)) {
+        if (nfields == 5)
+            return false;
+        fields[nfields++] = tok;
     }
 
-    *(args->resptr) = res;
-    pthread_exit(0);
+    long double start, end, steps = job->args.nsteps;
+    if ((nfields < 3) || !ld_conv(fields[1], &start) || !ld_conv(fields[2], &end) ||
+        ((end - start) <= EPSILON))
+        return false;
+    if ((nfields > 3) && (!ld_conv(fields[3], &steps) || ((long long)steps <= 0)))
+        return false;
+    if ((nfields > 4) && (NULL == (job->args.rule = integ_rule(fields[4]))))
+        return false;
+
+    job->args.funcname = fields[0];
+    job->args.start = start;
+    job->args.end = end;
+    job->args.nsteps = steps;
+
+    // there is a single result per line, so multi-output functions do not fit
+    *err = integ_load(ctx, fields[0], &job->func);
+    return (PE_OK != *err) || (1 == integ_nout(job->func));
+}
+
+static enum error run_batch(struct integ_ctx *ctx, const struct args *args)
+{
+    enum error err = PE_OK;
+    long long njobs = 0, nfailed = 0, lineno = 0;
+
+    FILE *file = strcmp(args->jobfile, "-") ? fopen(args->jobfile, "r") : stdin;
+    except(NULL == file, PE_WRONGARG, err, fopen_exc);
+
+    struct batch_job *jobs = calloc(BATCH_WINDOW, sizeof *jobs);
+    except(NULL == jobs, PE_MALLOC, err, jobs_exc);
+
+    // parse_job() cuts the line into pieces, so it is copied for the error message
+    char *line = NULL, *orig = NULL;
+    size_t linecap = 0, origcap = 0;
+    for (bool iseof = false; !iseof && (PE_OK == err);) {
+        long long nwin = 0;
+
+        while ((PE_OK == err) && (nwin < BATCH_WINDOW)) {
+            ssize_t len = getline(&line, &linecap, file);
+            if (len < 0) {
+                iseof = true;
+                except(ferror(file), PE_WRONGARG, err, window_exc);
+                break;
+            }
+            lineno++;
+
+            size_t skip = strspn(line, " \t\n");
+            if (('\0' == line[skip]) || ('#' == line[skip]))
+                continue;
+
+            line[strcspn(line, "\n")] = '\0';
+            if (origcap < linecap) {
+                char *tmp = realloc(orig, linecap);
+                except(NULL == tmp, PE_MALLOC, err, window_exc);
+                orig = tmp;
+                origcap = linecap;
+            }
+            strcpy(orig, line);
+
+            struct batch_job *job = &jobs[nwin];
+            *job = (struct batch_job){ .args = *args };
+            if (!parse_job(line, ctx, job, &job->err)) {
+                fprintf(stderr, "Bad job at line %lld\n", lineno);
+                job->err = PE_WRONGARG;
+            }
+            if (PE_OK != job->err) {
+                job->errline = job_errline(job->err, orig);
+                except(NULL == job->errline, PE_MALLOC, err, window_exc);
+            }
+            nwin++;
+        }
+
+        for (long long i = 0; (PE_OK == err) && (i < nwin); i++) {
+            struct batch_job *job = &jobs[i];
+            if (PE_OK != job->err)
+                continue;
+            job->err = integ_submit(ctx, &job->func, 1, &job->args.params, &job->job);
+            if (isfatal(job->err))
+                err = job->err;
+        }
+
+        // everything submitted is waited for, but nothing is printed after a fatal error
+        for (long long i = 0; i < nwin; i++) {
+            struct batch_job *job = &jobs[i];
+            struct integ_result res;
+            if (NULL != job->job) {
+                job->err = integ_wait(job->job, &res);
+                if (isfatal(job->err) && (PE_OK == err))
+                    err = job->err;
+            }
+            if (PE_OK != err)
+                continue;
+
+            if (PE_OK == job->err) {
+                printf("%.*Lg\n", RESULT_DIGITS, (long double)res.value);
+                continue;
+            }
+            if (NULL == job->errline)
+                job->errline = job_errline(job->err, NULL);
+            if (NULL == job->errline)
+                err = PE_MALLOC;
+            else
+                fputs(job->errline, stdout);
+            nfailed++;
+        }
+        fflush(stdout);
+        njobs += nwin;
+
+    window_exc:
+        for (long long i = 0; i < nwin; i++)
+            free(jobs[i].errline);
+    }
+
+    log("Batch of %lld jobs is done, %lld failed", njobs, nfailed);
+    if ((PE_OK == err) && nfailed)
+        err = PE_JOBS;
+
+    free(orig);
+    free(line);
+    free(jobs);
+jobs_exc:
+    if (stdin != file)
+        fclose(file);
+fopen_exc:
+    return err;
+}
+
+
+// Daemon mode.
+// Every client connection gets a thread which reads job lines, submits them and
+// waits for the results. The library computes jobs of all clients on the same
+// pool, so work of all clients is multiplexed onto -t threads, and many concurrent
+// tiny requests are computed together instead of one by one.
+struct daemon {
+    struct integ_ctx *ctx;
+    const struct args *args;
+    long long nrequests;    // updated atomically by connection threads
+};
+
+struct daemon_conn {
+    struct daemon *daemon;
+    int fd;
+};
+
+static void *daemon_client(void *argsptr)
+{
+    struct daemon_conn conn = *(struct daemon_conn *)argsptr;
+    struct daemon *d = conn.daemon;
+    free(argsptr);
+
+    FILE *in = fdopen(conn.fd, "r");
+    FILE *out = fdopen(dup(conn.fd), "w");
+    if ((NULL == in) || (NULL == out)) {
+        if (NULL != out)
+            fclose(out);
+        if (NULL != in)
+            fclose(in);
+        else
+            close(conn.fd);
+        return NULL;
+    }
+
+    char *line = NULL;
+    size_t linecap = 0;
+    while (getline(&line, &linecap, in) >= 0) {
+        size_t skip = strspn(line, " \t\n");
+        if (('\0' == line[skip]) || ('#' == line[skip]))
+            continue;
+
+        // parse_job() cuts the line into pieces, keep it for the error message
+        line[strcspn(line, "\n")] = '\0';
+        char *orig = strdup(line);
+
+        struct batch_job job = { .args = *d->args };
+        struct integ_result res;
+        if (!parse_job(line, d->ctx, &job, &job.err))
+            job.err = PE_WRONGARG;
+        if (PE_OK == job.err)
+            job.err = integ_submit(d->ctx, &job.func, 1, &job.args.params, &job.job);
+        if (PE_OK == job.err) {
+            __atomic_fetch_add(&d->nrequests, 1, __ATOMIC_RELAXED);
+            job.err = integ_wait(job.job, &res);
+        }
+
+        if (PE_OK == job.err) {
+            fprintf(out, "%.*Lg\n", RESULT_DIGITS, (long double)res.value);
+        } else {
+            // same messages as err_handler() reports
+            char *errline = job_errline(job.err, orig);
+            fputs(errline ?: "error: \n", out);
+            free(errline);
+        }
+        free(orig);
+
+        if (fflush(out))
+            break;    // client has gone
+    }
+
+    free(line);
+    fclose(out);
+    fclose(in);
+    return NULL;
+}
+
+static volatile sig_atomic_t daemon_isstopping = 0;
+
+static void daemon_stop(int signum)
+{
+    daemon_isstopping = signum;
+}
+
+static enum error run_daemon(struct integ_ctx *ctx, const struct args *args)
+{
+    enum error err = PE_OK;
+    struct daemon d = { .ctx = ctx, .args = args };
+
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    except(strlen(args->sockname) >= sizeof addr.sun_path, PE_WRONGARG, err, socket_exc);
+    strcpy(addr.sun_path, args->sockname);
+
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    except(sock < 0, PE_SOCKET, err, socket_exc);
+
+    // a stale socket file of a dead daemon would make bind() fail, so it is removed.
+    // But nothing else: not a file which is not a socket, and not the socket of
+    // a daemon which still answers there
+    struct stat st;
+    if (!lstat(args->sockname, &st)) {
+        if (!S_ISSOCK(st.st_mode))
+            fprintf(stderr, "'%s' exists and is not a socket\n", args->sockname);
+        except(!S_ISSOCK(st.st_mode), PE_SOCKET, err, bind_exc);
+
+        int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        bool islive = (probe >= 0) && !connect(probe, (struct sockaddr *)&addr, sizeof addr);
+        if (probe >= 0)
+            close(probe);
+        if (islive)
+            fprintf(stderr, "Another daemon is listening on '%s'\n", args->sockname);
+        except(islive, PE_SOCKET, err, bind_exc);
+        unlink(args->sockname);
+    }
+    except(bind(sock, (struct sockaddr *)&addr, sizeof addr), PE_SOCKET, err, bind_exc);
+    except(listen(sock, SOMAXCONN), PE_SOCKET, err, listen_exc);
+
+    // no SA_RESTART, so accept() gets interrupted and we can leave
+    struct sigaction sa = { .sa_handler = &daemon_stop };
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    // writing to a client which has gone must not kill the daemon
+    signal(SIGPIPE, SIG_IGN);
+
+    log("Listening on '%s'", args->sockname);
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    while (!daemon_isstopping) {
+        int fd = accept4(sock, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0) {
+            if ((EINTR == errno) || (ECONNABORTED == errno))
+                continue;
+            err = PE_SOCKET;
+            break;
+        }
+
+        struct daemon_conn *conn = malloc(sizeof *conn);
+        pthread_t thread;
+        if (NULL != conn)
+            *conn = (struct daemon_conn){ .daemon = &d, .fd = fd };
+        if ((NULL == conn) || pthread_create(&thread, &attr, &daemon_client, conn)) {
+            // we are out of resources, this client is refused
+            free(conn);
+            close(fd);
+        }
+    }
+    pthread_attr_destroy(&attr);
+
+    // Connection threads are not joined: they may be blocked by clients forever,
+    // and exit() takes care of them. Here we only need the counter
+    if (args->isverbose)
+        fprintf(stderr, "Served %lld requests\n", __atomic_load_n(&d.nrequests, __ATOMIC_RELAXED));
+
+listen_exc:
+    unlink(args->sockname);
+bind_exc:
+    close(sock);
+socket_exc:
+    return err;
+}
+
+
+// The single integral, or tabulation of the function with -T
+static enum error run_single(struct integ_ctx *ctx, const struct integrand *const *funcs,
+                             int nfuncs, const struct args *args, struct integ_result *res)
+{
+    if (NULL == args->tabfile)
+        return integ_run(ctx, funcs, nfuncs, &args->params, res);
+
+    struct integ_job *job;
+    enum error err = integ_tabulate(ctx, funcs[0], &args->params, args->tabfile, &job);
+    return (PE_OK == err) ? integ_wait(job, res) : err;
 }
 
 
 int main(int argc, char *argv[])
 {
     enum error err = PE_OK;
+    char *errarg = NULL;    // what err_handler() gets along with the error
+
+    // (!) make sure you know what happens if you use CLOCK_PROCESS_CPUTIME_ID
+    // with threads. And CLOCK_REALTIME may jump when the system time is adjusted
+    struct timespec tprogstart, tsetup, tstart, tstop;
+    clock_gettime(CLOCK_MONOTONIC, &tprogstart);
     log("Got %d arguments", argc);
     log("Progname: '%s'", argv[0]);
 
@@ -395,100 +1178,138 @@ int main(int argc, char *argv[])
 
     struct args args = parse_args(argc, argv);
 
-    char *funcname;
-    asprintf(&funcname, "%s%s", FUNC_PREFIX, args.funcname);
-    except(NULL == funcname, PE_MALLOC, err, funcname_alloc);
-
-    char *ldname;
-    asprintf(&ldname, "%s/%s.so", bindir, funcname);
-    except(NULL == funcname, PE_MALLOC, err, ldname_alloc);
-
-    log("Trying to load func '%s' from '%s'", funcname, ldname);
-
-    void *handle = dlopen(ldname, RTLD_NOW | RTLD_LOCAL);
-    except(NULL == handle, PE_DLERR, err, dlopen_exc);
-
-    funcptr_t dlfunc = dlsym(handle, funcname);
-    except(NULL == dlfunc, PE_DLERR, err, dlsym_exc);
-
-    // I use alloca here cause I'm feeling lazy to manage all deallocs
-    pthread_t *threads = alloca(args.nthreads * sizeof *threads);
-
-    struct thread_args *thargs = alloca(args.nthreads * sizeof *thargs);
-
-    farg_t *results = alloca(args.nthreads * sizeof *results);
-    memset(results, 0, args.nthreads * sizeof *results);
-
-    except((NULL == threads) || (NULL == thargs) || (NULL == results), PE_MALLOC, err, dlsym_exc);
-
-    farg_t interval = args.end - args.start;
-    farg_t step = interval / args.nsteps;
-    farg_t part = interval / args.nthreads;
-
-    for (long long i = 0; i < args.nthreads; i++) {
-        thargs[i] = (struct thread_args){ .start = part * i,
-                                          .end = part * (i + 1),
-                                          .step = step,
-                                          .funcptr = dlfunc,
-                                          .resptr = &results[i] };
-
-        log("Thread #%lld args <[%Lg; %Lg] / %Lg>", i + 1, 
-            (long double)thargs[i].start,
-            (long double)thargs[i].end,
-            (long double)thargs[i].step);
+    // plugins are looked up next to the executable
+    int *cpus = alloca(CPU_SETSIZE * sizeof *cpus);
+    int ncpus = affinity_cpus(args.affinity, cpus);
+    struct integ_config config = {
+        .nthreads = args.nthreads,
+        .cpus = args.affinity ? cpus : NULL,
+        .ncpus = ncpus,
+        .plugindir = bindir,
+        .cachefile = args.cachefile,
+        .cacheslots = args.cacheslots,
+        .isstats = args.isstats
+    };
+    struct integ_ctx *ctx;
+    err = integ_create(&config, &ctx);
+    errarg = (char *)args.cachefile;
+    except(PE_OK != err, err, err, ctx_exc);
+
+    if (args.isverbose && args.affinity) {
+        for (long long i = 0; i < args.nthreads; i++) {
+            int cpu = cpus[i % ncpus];
+            struct cpu_topology topo = cpu_topology(cpu);
+            fprintf(stderr, "Thread #%lld on CPU %d (package %d, core %d)\n",
+                    i, cpu, topo.package, topo.core);
+        }
     }
 
-    struct timespec tstart, tstop;
-
-    // (!) make sure you know what happens if you use CLOCK_PROCESS_CPUTIME_ID
-    // with threads
-    clock_gettime(CLOCK_REALTIME, &tstart);
-    // start threads
-    for (long long i = 0; i < args.nthreads; i++) {
-        // running each thread is like running:
-        //      integrate_worker(&thargs[i]);
-        // except that we're running it in thread xD
-
-        int code = pthread_create(&threads[i], NULL, &integrate_worker, &thargs[i]);
-
-        // dealloc if something goes wrong
-        if (code) {
-            for (long long k = i; k >= 0; k--) {
-                pthread_cancel(threads[i]);
-            }
-            err = PE_THREAD;
-            goto dlsym_exc;
+    const struct integrand *funcs[MAX_FUSED];
+    int nfuncs = 0, nout = 0;
+    bool issingle = (NULL == args.jobfile) && (NULL == args.sockname);
+    if (issingle && (NULL != args.samplefile)) {
+        err = integ_samples(ctx, args.samplefile, &funcs[nfuncs]);
+        errarg = (char *)args.samplefile;
+        except(PE_OK != err, err, err, run_exc);
+        nout += integ_nout(funcs[nfuncs++]);
+    } else if (issingle && (NULL != args.expression)) {
+        size_t errpos;
+        const char *errmsg;
+        err = integ_expr(ctx, args.expression, &funcs[nfuncs], &errpos, &errmsg);
+        if (PE_WRONGARG == err)
+            fprintf(stderr, "%s\n%*s^ %s\n", args.expression, (int)errpos, "", errmsg);
+        errarg = (char *)args.expression;
+        except(PE_OK != err, err, err, run_exc);
+        nout += integ_nout(funcs[nfuncs++]);
+    } else if (issingle) {
+        // -F may list several functions to be integrated in a single pass
+        char *names = strdupa(args.funcname), *saveptr;
+        errarg = (char *)args.funcname;
+        for (char *name = strtok_r(names, ",", &saveptr); NULL != name;
+             name = strtok_r(NULL, ",", &saveptr)) {
+            except(MAX_FUSED == nfuncs, PE_WRONGARG, err, run_exc);
+            err = integ_load(ctx, name, &funcs[nfuncs]);
+            except(PE_OK != err, err, err, run_exc);
+            nout += integ_nout(funcs[nfuncs++]);
         }
+        // a sample file gets a single function
+        except((0 == nfuncs) || (nout > MAX_FUSED) || ((NULL != args.tabfile) && (nout > 1)),
+               PE_WRONGARG, err, run_exc);
     }
 
-    // wait for threads to finish
-    for (long long i = 0; i < args.nthreads; i++) {
-        pthread_join(threads[i], NULL);
+    // a sweep has a result per parameter value
+    long long nres = (args.nparams > 1) ? args.nparams : nout;
+    struct integ_result *res = calloc(nres, sizeof *res);
+    except(NULL == res, PE_MALLOC, err, run_exc);
+    clock_gettime(CLOCK_MONOTONIC, &tsetup);
+
+    // only a single integral is repeated
+    long long nreps = issingle ? args.nreps : 1;
+    long long nwarmups = issingle ? args.nwarmups : 0;
+    // -r may be large, so not on the stack
+    long long *took_ns = calloc(nreps, sizeof *took_ns);
+    except(NULL == took_ns, PE_MALLOC, err, res_exc);
+
+    for (long long i = -nwarmups; (i < 0) && (PE_OK == err); i++)
+        err = run_single(ctx, funcs, nfuncs, &args, res);
+
+    for (long long i = 0; (i < nreps) && (PE_OK == err); i++) {
+        clock_gettime(CLOCK_MONOTONIC, &tstart);
+        if (NULL != args.sockname) {
+            err = run_daemon(ctx, &args);
+            errarg = (char *)args.sockname;
+        } else if (NULL != args.jobfile) {
+            err = run_batch(ctx, &args);
+            errarg = (char *)args.jobfile;
+        } else
+            err = run_single(ctx, funcs, nfuncs, &args, res);
+        clock_gettime(CLOCK_MONOTONIC, &tstop);
+        took_ns[i] = diff_ns(tstart, tstop);
     }
-
-    clock_gettime(CLOCK_REALTIME, &tstop);
-
-    long long took_us = diff_us(tstart, tstop);
-
-    farg_t sum = .0;
-    for (long long i = 0; i < args.nthreads; i++) {
-        sum += results[i];
+    except(PE_OK != err, err, err, res_exc);
+
+    // nearest rank percentiles
+    qsort(took_ns, nreps, sizeof *took_ns, &cmp_ll);
+    long long median_ns = (took_ns[(nreps - 1) / 2] + took_ns[nreps / 2]) / 2;
+    long long p95_ns = took_ns[(95 * nreps + 99) / 100 - 1];
+
+    long long nevals = 0;
+    for (long long o = 0; issingle && (o < nres); o++) {
+        if (NULL == args.tabfile)
+            printf("%.*Lg\n", RESULT_DIGITS, (long double)res[o].value);
+        nevals += res[o].nevals;
     }
 
-    printf("%Lg\n", (long double)sum);
+    if (args.isverbose) {
+        if (issingle &&
+            ((args.tolerance > 0) || (SAMPLING_GRID != args.sampling) || args.isromberg))
+            fprintf(stderr, "Error estimate %.8Lg\n", (long double)res[0].errest);
+        if (issingle)
+            fprintf(stderr, "Evaluations %lld\n", nevals);
+        fprintf(stderr, "Setup %.9Lg s\n", diff_ns(tprogstart, tsetup) / 1e9L);
+        fprintf(stderr, "Took %.9Lg s\n", median_ns / 1e9L);
+        if (nreps > 1)
+            fprintf(stderr, "P95 %.9Lg s\n", p95_ns / 1e9L);
+        if (NULL != args.cachefile) {
+            long long nhits, nmisses;
+            integ_cache_stats(ctx, &nhits, &nmisses);
+            fprintf(stderr, "Cache hits %lld misses %lld\n", nhits, nmisses);
+        }
+    }
 
-    if (args.isverbose)
-        fprintf(stderr, "Took %.8Lg s\n", took_us / 1e6L);
+    if (args.isstats)
+        integ_report_stats(ctx, stderr);
 
-dlsym_exc:
-    dlclose(handle);
-dlopen_exc:
-    free(ldname);
-ldname_alloc:
-    free(funcname);
-funcname_alloc:
+res_exc:
+    free(took_ns);
+    free(res);
+run_exc:
+    integ_destroy(ctx);
+ctx_exc:
     free(bindir);
 bindir_alloc:
-    err_handler(err, NULL);
+    // the library knows which file has failed, see integ_errdetail()
+    bool isdetail = (PE_DLERR == err) || (PE_SAMPLES == err);
+    err_handler(err, isdetail ? (char *)integ_errdetail() : errarg);
     return 0;
 }
@@ -0,0 +1,2770 @@
+/**
+ * libintegrate -- the integration engine of dlintegrate, see libintegrate.h.
+ *
+ * Fixed step rules, adaptive Gauss-Kronrod, progressive Romberg and sampling
+ * methods on a persistent pool of threads, plugin loading, sample files and the
+ * result cache live here. dlintegrate.c is just a command line client of this.
+ * Errors are returned and never reported: the calling thread gets the details
+ * with integ_errdetail(), and a job computed by the dispatcher carries its error
+ * until integ_wait().
+ */
+
+// gcc -O2 -std=gnu18 -fPIC -c dlexpr.c -o dlexpr.o (add -ffast-math -fopenmp-simd, see dlexpr.c)
+// gcc -DDEBUG=0 -O2 -std=gnu18 -fPIC -c libintegrate.c -o libintegrate.o
+// ar rcs libintegrate.a libintegrate.o dlexpr.o
+// gcc -shared libintegrate.o dlexpr.o -lm -pthread -ldl -o libintegrate.so
+
+#define _GNU_SOURCE
+#include "libintegrate.h"
+#include "dlexpr.h"             /* built-in expression integrands    */
+#include <dlfcn.h>              /* dynamic loading support           */
+#include <errno.h>
+#include <fcntl.h>              /* open() of the cache, sample files */
+#include <linux/perf_event.h>   /* hardware counters for stats       */
+#include <float.h>
+#include <inttypes.h>           /* PRIu64 for hardware counters      */
+#include <math.h>
+#include <pthread.h>            /* POSIX threading                   */
+#include <sched.h>              /* CPU sets for thread affinity      */
+#include <sys/file.h>           /* flock() of the result cache       */
+#include <sys/mman.h>           /* the cache and samples are mapped  */
+#include <sys/stat.h>
+#include <sys/syscall.h>        /* perf_event_open has no wrapper    */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// number of points passed to the plugin per call
+#define BATCH_SIZE 256
+// number of independent partial sums when adding up a block of values
+#define SUM_LANES 16
+// Automatic chunk size: at most MAX_AUTO_CHUNKS chunks, but not smaller than MIN_AUTO_CHUNK
+// steps, so that taking a chunk costs nothing compared to evaluating it
+#define MIN_AUTO_CHUNK (16 * BATCH_SIZE)
+// Significant digits of traced estimates
+#define RESULT_DIGITS DBL_DIG
+
+// Simple logging facility
+// When compiled with -DDEBUG=1, the logging will appear on stderr
+#if defined(DEBUG) && DEBUG
+#define log(x, ...) fprintf(stderr, " >> LOG %s @ L%d: " x "\n", __func__, __LINE__,##__VA_ARGS__)
+#else
+#define log(x, ...)
+#endif
+
+#define except(condition, seterr, errptr, gotoptr) \
+    {                                              \
+        bool cond = (condition);                   \
+        if (cond) {                                \
+            errptr = (seterr);                     \
+            goto gotoptr;                          \
+        }                                          \
+        cond;                                      \
+    }
+
+// This is the type of arguments, results and the plugin interface. The hot loop
+// may run in another precision (see enum precision and libintegrate_kernel.h)
+typedef double farg_t;
+typedef farg_t (*funcptr_t)(farg_t);
+// ys[i] = f(xs[i]) for i in [0; n)
+typedef void (*batchfuncptr_t)(const farg_t *restrict xs, farg_t *restrict ys, size_t n);
+// and the same in single and extended precision
+typedef float (*funcptrf_t)(float);
+typedef long double (*funcptrl_t)(long double);
+typedef void (*batchfuncptrf_t)(const float *restrict xs, float *restrict ys, size_t n);
+typedef void (*batchfuncptrl_t)(const long double *restrict xs, long double *restrict ys,
+                                size_t n);
+// Multi-dimensional functions take a point x[0..dim) and the batched variant takes
+// n points one after another: point i is xs[i * dim .. (i + 1) * dim)
+typedef farg_t (*ndfuncptr_t)(const farg_t *x, unsigned dim);
+// Several functions at once: output o of point i is ys[o * n + i]
+typedef void (*multifuncptr_t)(const farg_t *restrict xs, farg_t *restrict ys, size_t n);
+// Functions of a parameter p, scalar and batched
+typedef farg_t (*paramfuncptr_t)(farg_t x, farg_t p);
+typedef void (*parambatchfuncptr_t)(const farg_t *restrict xs, farg_t *restrict ys, size_t n,
+                                    farg_t p);
+typedef void (*ndbatchfuncptr_t)(const farg_t *restrict xs, farg_t *restrict ys, size_t n,
+                                 unsigned dim);
+
+
+// And here we rely on designated init GCC extension
+static const char *const error_msg[] = {
+    [PE_OK]       = "",
+    [PE_NOARGS]   = "No arguments provided",
+    [PE_WRONGARG] = "Wrong argument '%s'",
+    [PE_NENARGS]  = "Not enough arguments",
+    [PE_TMARGS]   = "Too many arguments",
+    [PE_CVGERR]   = "Convergence unreachable",
+    [PE_MALLOC]   = "Could not allocate memory",
+    [PE_THREAD]   = "Threading error",
+    [PE_DLERR]    = "Dynamic loader (%s)",
+    [PE_SOCKET]   = "Socket error on '%s'",
+    [PE_CACHE]    = "Cache file error on '%s'",
+    [PE_SAMPLES]  = "Sample file error on '%s'",
+    [PE_JOBS]     = "Some jobs from '%s' have failed",
+    [__PE_LAST]   = NULL
+};
+
+// Details of the last error of this thread. Loader failures are reported after
+// dlclose() calls which reset dlerror(), so its message is kept here as well
+static __thread char errdetail[256];
+
+const char *integ_strerror(enum error err)
+{
+    return ((err >= PE_OK) && (err < __PE_LAST)) ? error_msg[err] : "Unknown error";
+}
+
+const char *integ_errdetail(void)
+{
+    return errdetail;
+}
+
+
+// Quadrature rules for the fixed step methods.
+// Every step of the grid is a panel [x; x + step], and a rule gives the nodes inside
+// the panel (as fractions of the step) and their weights (summing up to 1).
+// Closed rules also have a node at the right end of a panel which coincides with the
+// left node of the next one. Such nodes are evaluated once: their weight is merged into
+// the left node weight and endweight * (f(end) - f(start)) corrects the sum at the ends.
+#define MAX_RULE_POINTS 5
+
+struct rule {
+    const char *name;
+    int npoints;
+    farg_t nodes[MAX_RULE_POINTS];
+    farg_t weights[MAX_RULE_POINTS];
+    farg_t endweight;
+};
+
+// Gauss-Legendre nodes and weights are usually tabulated for [-1; 1],
+// these map them onto [0; 1] at compile time
+#define GL_NODE(x) ((1 + (x)) / 2)
+#define GL_WEIGHT(w) ((w) / 2)
+
+static const struct rule RULES[] = {
+    { .name = "left", .npoints = 1, .nodes = { 0 }, .weights = { 1 } },
+    { .name = "midpoint", .npoints = 1, .nodes = { .5 }, .weights = { 1 } },
+    { .name = "trapezoid", .npoints = 1, .nodes = { 0 }, .weights = { 1 }, .endweight = .5 },
+    { .name = "simpson", .npoints = 2, .nodes = { 0, .5 }, .weights = { 2. / 6, 4. / 6 },
+      .endweight = 1. / 6 },
+    { .name = "gauss2", .npoints = 2,
+      .nodes = { GL_NODE(-0.5773502691896257645091488), GL_NODE(0.5773502691896257645091488) },
+      .weights = { GL_WEIGHT(1.), GL_WEIGHT(1.) } },
+    { .name = "gauss3", .npoints = 3,
+      .nodes = { GL_NODE(-0.7745966692414833770358531), GL_NODE(0.),
+                 GL_NODE(0.7745966692414833770358531) },
+      .weights = { GL_WEIGHT(5. / 9), GL_WEIGHT(8. / 9), GL_WEIGHT(5. / 9) } },
+    { .name = "gauss4", .npoints = 4,
+      .nodes = { GL_NODE(-0.8611363115940525752239465), GL_NODE(-0.3399810435848562648026658),
+                 GL_NODE(0.3399810435848562648026658), GL_NODE(0.8611363115940525752239465) },
+      .weights = { GL_WEIGHT(0.3478548451374538573730639),
+                   GL_WEIGHT(0.6521451548625461426269361),
+                   GL_WEIGHT(0.6521451548625461426269361),
+                   GL_WEIGHT(0.3478548451374538573730639) } },
+    { .name = "gauss5", .npoints = 5,
+      .nodes = { GL_NODE(-0.9061798459386639927976269), GL_NODE(-0.5384693101056830910363144),
+                 GL_NODE(0.), GL_NODE(0.5384693101056830910363144),
+                 GL_NODE(0.9061798459386639927976269) },
+      .weights = { GL_WEIGHT(0.2369268850561890875142640),
+                   GL_WEIGHT(0.4786286704993664680412915),
+                   GL_WEIGHT(0.5688888888888888888888889),
+                   GL_WEIGHT(0.4786286704993664680412915),
+                   GL_WEIGHT(0.2369268850561890875142640) } },
+};
+
+#define NRULES (sizeof RULES / sizeof RULES[0])
+
+const struct rule *integ_rule(const char *name)
+{
+    for (size_t i = 0; i < NRULES; i++) {
+        if (!strcmp(name, RULES[i].name))
+            return &RULES[i];
+    }
+    return NULL;
+}
+
+
+static long long diff_ns(struct timespec t1, struct timespec t2)
+{
+    return (long long)(t2.tv_sec - t1.tv_sec) * 1000000000LL + (t2.tv_nsec - t1.tv_nsec);
+}
+
+
+// What we know about the loaded function. At least one of func and batch is not NULL.
+// Batched entry points are preferred, calling the scalar one per point is a fallback
+// for plugins which do not provide them. Evaluation is done by integrand_eval*()
+// from libintegrate_kernel.h
+struct integrand {
+    const char *name;          // plugin funcname or the expression
+    funcptr_t func;
+    batchfuncptr_t batch;
+    // other precisions, optional
+    funcptrf_t funcf;
+    funcptrl_t funcl;
+    batchfuncptrf_t batchf;
+    batchfuncptrl_t batchl;
+    const struct expr *expr;   // an expression, all the above are NULL
+    // multi-dimensional, used by the sampling methods only. A library may
+    // export these alone, then func and batch are NULL
+    ndfuncptr_t ndfunc;
+    ndbatchfuncptr_t ndbatch;
+    // fused outputs, used by the fixed step rules. nout is 1 without multi
+    multifuncptr_t multi;
+    unsigned nout;
+    // of a parameter, used instead of the above when there is one
+    paramfuncptr_t paramfunc;
+    parambatchfuncptr_t parambatch;
+    const struct samples *samples;    // a sample file, all the above are NULL
+    uint64_t id;    // hash of the library contents or expression, 0 if unknown
+};
+
+
+// Persistent pool of worker threads.
+// Threads are created once and sleep on a condition variable between runs, so
+// pthread_create is paid once per process and not once per integration.
+// pool_run() hands the same job to every worker and waits until all of them return.
+typedef void (*jobfunc_t)(void *ctx, long long worker);
+
+// Evaluations done by the current thread, counted by integrand_eval*()
+static __thread long long thread_nevals;
+// Parameter of the integral the thread computes, NULL if there is none. Set per
+// chunk by fixed step methods, so that it reaches the plugin through the kernels
+static __thread const farg_t *thread_param;
+
+// What workers have done over all pool_run() calls, collected if asked for.
+// Reading the clocks and counters costs a few syscalls per job and worker
+struct worker_stats {
+    long long nevals;
+    long long wall_ns;
+    long long cpu_ns;           // CLOCK_THREAD_CPUTIME_ID
+    uint64_t ncycles;           // hardware counters, if perffd is valid
+    uint64_t ninstructions;
+    int perffd[2];              // group leader counts cycles
+};
+
+struct pool {
+    pthread_mutex_t lock;
+    pthread_cond_t wakeup;      // signalled when a new job is posted
+    pthread_cond_t finished;    // signalled when the last worker is done with the job
+    pthread_mutex_t runlock;    // serializes concurrent pool_run() callers
+    pthread_t *threads;
+    long long nthreads;
+    jobfunc_t job;
+    void *ctx;
+    unsigned long long generation;
+    long long nrunning;
+    bool isstopping;
+    struct worker_stats *stats;    // one per worker, NULL unless requested
+};
+
+// Open per-thread cycles and instructions counters. Fails on most VMs, in containers
+// and when perf_event_paranoid forbids it. Stats are reported without them then
+static void perf_open(int fds[2])
+{
+    struct perf_event_attr attr = {
+        .type = PERF_TYPE_HARDWARE,
+        .size = sizeof attr,
+        .config = PERF_COUNT_HW_CPU_CYCLES,
+        .read_format = PERF_FORMAT_GROUP,
+        .exclude_kernel = 1,
+        .exclude_hv = 1
+    };
+    fds[0] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    if (fds[0] < 0) {
+        fds[1] = -1;
+        return;
+    }
+
+    attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+    fds[1] = syscall(SYS_perf_event_open, &attr, 0, -1, fds[0], 0);
+    if (fds[1] < 0) {
+        close(fds[0]);
+        fds[0] = -1;
+    }
+}
+
+static void perf_read(const int fds[2], uint64_t counters[2])
+{
+    // layout of PERF_FORMAT_GROUP: number of counters, then their values
+    uint64_t buf[3] = { 0 };
+    if ((fds[0] < 0) || (read(fds[0], buf, sizeof buf) != sizeof buf))
+        buf[1] = buf[2] = 0;
+    counters[0] = buf[1];
+    counters[1] = buf[2];
+}
+
+// Run the job on behalf of a worker, accounting what it costs
+static void pool_worker_job(struct worker_stats *stats, jobfunc_t job, void *ctx, long long id)
+{
+    struct timespec wall0, wall1, cpu0, cpu1;
+    uint64_t ctr0[2], ctr1[2];
+
+    perf_read(stats->perffd, ctr0);
+    clock_gettime(CLOCK_MONOTONIC, &wall0);
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu0);
+    thread_nevals = 0;
+
+    job(ctx, id);
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu1);
+    clock_gettime(CLOCK_MONOTONIC, &wall1);
+    perf_read(stats->perffd, ctr1);
+
+    stats->nevals += thread_nevals;
+    stats->wall_ns += diff_ns(wall0, wall1);
+    stats->cpu_ns += diff_ns(cpu0, cpu1);
+    stats->ncycles += ctr1[0] - ctr0[0];
+    stats->ninstructions += ctr1[1] - ctr0[1];
+}
+
+struct pool_worker_args {
+    struct pool *pool;
+    long long id;
+};
+
+static void *pool_worker(void *argsptr)
+{
+    struct pool_worker_args wargs = *(struct pool_worker_args *)argsptr;
+    struct pool *pool = wargs.pool;
+    struct worker_stats *stats = pool->stats ? &pool->stats[wargs.id] : NULL;
+    free(argsptr);
+
+    if (stats)
+        perf_open(stats->perffd);
+
+    unsigned long long seen = 0;
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (!pool->isstopping && (pool->generation == seen))
+            pthread_cond_wait(&pool->wakeup, &pool->lock);
+        if (pool->isstopping)
+            break;
+
+        seen = pool->generation;
+        jobfunc_t job = pool->job;
+        void *ctx = pool->ctx;
+        pthread_mutex_unlock(&pool->lock);
+
+        if (stats)
+            pool_worker_job(stats, job, ctx, wargs.id);
+        else
+            job(ctx, wargs.id);
+
+        pthread_mutex_lock(&pool->lock);
+        if (0 == --pool->nrunning)
+            pthread_cond_signal(&pool->finished);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    if (stats && (stats->perffd[0] >= 0)) {
+        close(stats->perffd[1]);
+        close(stats->perffd[0]);
+    }
+    return NULL;
+}
+
+static void pool_destroy(struct pool *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->isstopping = true;
+    pthread_cond_broadcast(&pool->wakeup);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (long long i = 0; i < pool->nthreads; i++)
+        pthread_join(pool->threads[i], NULL);
+
+    free(pool->stats);
+    free(pool->threads);
+    free(pool);
+}
+
+// Worker i is pinned to cpus[i % ncpus] unless cpus is NULL
+static enum error pool_create(long long nthreads, const int *cpus, int ncpus, bool isstats,
+                              struct pool **poolptr)
+{
+    struct pool *pool = calloc(1, sizeof *pool);
+    if (NULL == pool)
+        return PE_MALLOC;
+
+    if (isstats) {
+        pool->stats = calloc(nthreads, sizeof *pool->stats);
+        if (NULL == pool->stats) {
+            free(pool);
+            return PE_MALLOC;
+        }
+    }
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_mutex_init(&pool->runlock, NULL);
+    pthread_cond_init(&pool->wakeup, NULL);
+    pthread_cond_init(&pool->finished, NULL);
+
+    pool->threads = calloc(nthreads, sizeof *pool->threads);
+    if (NULL == pool->threads) {
+        free(pool->stats);
+        free(pool);
+        return PE_MALLOC;
+    }
+
+    for (; pool->nthreads < nthreads; pool->nthreads++) {
+        struct pool_worker_args *wargs = malloc(sizeof *wargs);
+        if (NULL != wargs)
+            *wargs = (struct pool_worker_args){ .pool = pool, .id = pool->nthreads };
+
+        // pinned right from the start, so no memory is touched on a wrong node
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        if (NULL != cpus) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(cpus[pool->nthreads % ncpus], &set);
+            pthread_attr_setaffinity_np(&attr, sizeof set, &set);
+        }
+
+        int code = (NULL == wargs) ||
+                   pthread_create(&pool->threads[pool->nthreads], &attr, &pool_worker, wargs);
+        pthread_attr_destroy(&attr);
+        if (code) {
+            // threads started so far are stopped and joined
+            free(wargs);
+            pool_destroy(pool);
+            return PE_THREAD;
+        }
+    }
+
+    *poolptr = pool;
+    return PE_OK;
+}
+
+// Run job(ctx, id) on every worker of the pool, id in [0; nthreads). Blocks until all are done
+static void pool_run(struct pool *pool, jobfunc_t job, void *ctx)
+{
+    pthread_mutex_lock(&pool->runlock);
+    pthread_mutex_lock(&pool->lock);
+    pool->job = job;
+    pool->ctx = ctx;
+    pool->nrunning = pool->nthreads;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->wakeup);
+
+    while (pool->nrunning)
+        pthread_cond_wait(&pool->finished, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+    pthread_mutex_unlock(&pool->runlock);
+}
+
+static void pool_report_stats(struct pool *pool, FILE *out)
+{
+    long long max_nevals = 0, sum_nevals = 0, max_cpu = 0, sum_cpu = 0;
+    bool hascounters = true;
+
+    // nobody is running, so the stats are stable
+    pthread_mutex_lock(&pool->runlock);
+    fprintf(out, "%-8s %14s %12s %12s %16s %16s\n",
+            "Thread", "Evaluations", "Wall, s", "CPU, s", "Cycles", "Instructions");
+    for (long long i = 0; i < pool->nthreads; i++) {
+        struct worker_stats *st = &pool->stats[i];
+        fprintf(out, "#%-7lld %14lld %12.6f %12.6f", i, st->nevals,
+                st->wall_ns / 1e9, st->cpu_ns / 1e9);
+        if (st->perffd[0] >= 0)
+            fprintf(out, " %16" PRIu64 " %16" PRIu64 "\n", st->ncycles, st->ninstructions);
+        else
+            fprintf(out, " %16s %16s\n", "n/a", "n/a");
+
+        hascounters = hascounters && (st->perffd[0] >= 0);
+        max_nevals = (st->nevals > max_nevals) ? st->nevals : max_nevals;
+        max_cpu = (st->cpu_ns > max_cpu) ? st->cpu_ns : max_cpu;
+        sum_nevals += st->nevals;
+        sum_cpu += st->cpu_ns;
+    }
+    pthread_mutex_unlock(&pool->runlock);
+
+    // 1.0 means perfectly balanced, nthreads means one thread did everything
+    fprintf(out, "Imbalance %.4f evaluations, %.4f CPU time\n",
+            sum_nevals ? (double)max_nevals * pool->nthreads / sum_nevals : 1.,
+            sum_cpu ? (double)max_cpu * pool->nthreads / sum_cpu : 1.);
+    if (!hascounters)
+        fprintf(out, "Hardware counters are not available\n");
+}
+
+
+// Hot loops for every precision
+
+#define KERNEL_T farg_t
+#define KERNEL_SFX
+#define KERNEL_WIDE farg_t
+#define KERNEL_NATIVE
+#include "libintegrate_kernel.h"
+#undef KERNEL_NATIVE
+#undef KERNEL_WIDE
+#undef KERNEL_SFX
+#undef KERNEL_T
+
+#define KERNEL_T float
+#define KERNEL_SFX f
+#define KERNEL_WIDE farg_t
+#include "libintegrate_kernel.h"
+#undef KERNEL_WIDE
+#undef KERNEL_SFX
+#undef KERNEL_T
+
+#define KERNEL_T long double
+#define KERNEL_SFX l
+#define KERNEL_WIDE long double
+#include "libintegrate_kernel.h"
+#undef KERNEL_WIDE
+#undef KERNEL_SFX
+#undef KERNEL_T
+
+
+// Work stealing.
+// The grid is cut into chunks of args->chunksteps steps. Each worker initially owns
+// a contiguous range of chunk indices [head; tail) and takes chunks from its head.
+// When it runs out of work, it steals the upper half of another worker's range.
+// So a worker stuck with an expensive region or descheduled by the OS is helped
+// by the others instead of keeping them idle.
+// Every deque sits on its own cache line, so owners do not disturb each other.
+struct chunkdeque {
+    pthread_mutex_t lock;
+    long long head;
+    long long tail;
+} __attribute__((aligned(64)));
+
+struct fixed_job {
+    const struct integrand *const *funcs;    // all computed in a single pass
+    int nfuncs;
+    int nout;                      // outputs of all funcs
+    const struct rule *rule;
+    enum precision precision;
+    farg_t start;
+    farg_t end;
+    farg_t step;
+    farg_t param;
+    bool isparam;                  // param is passed to the funcs
+    long long nsteps;
+    long long chunksteps;
+    long long nchunks;
+    struct chunkdeque *deques;     // one per worker
+    long long ndeques;
+    farg_t *sums;                  // nout per chunk
+};
+
+// Chunk size does not depend on the number of threads, and chunk sums are added
+// in the chunk order. This way the result does not depend on threads or stealing
+static struct fixed_job fixed_job_init(const struct integ_params *args,
+                                       const struct integrand *const *funcs, int nfuncs)
+{
+    int nout = 0;
+    for (int f = 0; f < nfuncs; f++)
+        nout += funcs[f]->nout;
+
+    long long chunksteps = args->chunksteps;
+    if (0 == chunksteps) {
+        chunksteps = args->nsteps / MAX_AUTO_CHUNKS;
+        chunksteps = (chunksteps > MIN_AUTO_CHUNK) ? chunksteps : MIN_AUTO_CHUNK;
+    }
+
+    return (struct fixed_job){
+        .funcs = funcs,
+        .nfuncs = nfuncs,
+        .nout = nout,
+        .rule = args->rule,
+        .precision = args->precision,
+        .start = args->start,
+        .end = args->end,
+        .step = (args->end - args->start) / args->nsteps,
+        .param = args->param,
+        .isparam = (args->nparams > 0),
+        .nsteps = args->nsteps,
+        .chunksteps = chunksteps,
+        .nchunks = (args->nsteps + chunksteps - 1) / chunksteps
+    };
+}
+
+// Sums of all outputs over the chunk
+static void fixed_chunk(const struct fixed_job *job, long long chunk, farg_t *sums)
+{
+    long long first = chunk * job->chunksteps;
+    long long last = (first + job->chunksteps < job->nsteps) ? first + job->chunksteps
+                                                            : job->nsteps;
+    // the thread may be used by other methods next, which do not reset it
+    thread_param = job->isparam ? &job->param : NULL;
+    if (PREC_FLOAT == job->precision)
+        integrate_chunkf(job->funcs, job->nfuncs, job->nout, job->rule, job->start, job->step,
+                         first, last, sums);
+    else if (PREC_LDOUBLE == job->precision)
+        integrate_chunkl(job->funcs, job->nfuncs, job->nout, job->rule, job->start,
+                         ((long double)job->end - job->start) / job->nsteps, first, last, sums);
+    else
+        integrate_chunk(job->funcs, job->nfuncs, job->nout, job->rule, job->start, job->step,
+                        first, last, sums);
+    thread_param = NULL;
+}
+
+// Apply the end correction of closed rules to the totals of all chunks
+static void fixed_finish(const struct fixed_job *job, const farg_t *sums, struct integ_result *res)
+{
+    long long nevals = job->nsteps * job->rule->npoints;
+    farg_t corrections[MAX_FUSED] = { .0 };
+    thread_param = job->isparam ? &job->param : NULL;
+    if (job->rule->endweight) {
+        farg_t xs[] = { job->start, job->start + job->nsteps * job->step }, ys[2 * MAX_FUSED];
+        for (int f = 0, o = 0; f < job->nfuncs; o += job->funcs[f++]->nout) {
+            integrand_eval_multi(job->funcs[f], xs, ys, 2);
+            for (unsigned k = 0; k < job->funcs[f]->nout; k++)
+                corrections[o + k] = job->rule->endweight * job->step * (ys[2 * k + 1] - ys[2 * k]);
+        }
+        nevals += 2;
+    }
+    thread_param = NULL;
+
+    for (int o = 0; o < job->nout; o++)
+        res[o] = (struct integ_result){ .value = sums[o] + corrections[o], .nevals = nevals };
+}
+
+static bool deque_take(struct chunkdeque *dq, long long *chunk)
+{
+    pthread_mutex_lock(&dq->lock);
+    bool ok = dq->head < dq->tail;
+    if (ok)
+        *chunk = dq->head++;
+    pthread_mutex_unlock(&dq->lock);
+    return ok;
+}
+
+// Move upper half of victim's chunks to own (empty) deque
+static bool deque_steal(struct chunkdeque *victim, struct chunkdeque *own)
+{
+    pthread_mutex_lock(&victim->lock);
+    long long left = victim->tail - victim->head;
+    long long first = victim->tail - (left + 1) / 2, last = victim->tail;
+    if (left > 0)
+        victim->tail = first;
+    pthread_mutex_unlock(&victim->lock);
+
+    if (left <= 0)
+        return false;
+
+    pthread_mutex_lock(&own->lock);
+    own->head = first;
+    own->tail = last;
+    pthread_mutex_unlock(&own->lock);
+    return true;
+}
+
+// Next chunk of worker id: its own one or a stolen one. False when all are taken
+static bool deque_next(struct chunkdeque *deques, long long ndeques, long long id,
+                       long long *chunk)
+{
+    while (!deque_take(&deques[id], chunk)) {
+        // No new chunks ever appear, so if everyone is empty we are done
+        bool isstolen = false;
+        for (long long k = 1; (k < ndeques) && !isstolen; k++)
+            isstolen = deque_steal(&deques[(id + k) % ndeques], &deques[id]);
+        if (!isstolen)
+            return false;
+    }
+    return true;
+}
+
+// Deques of nchunks chunks for ndeques workers, initially the split is the same
+// as a static one
+static struct chunkdeque *deques_create(long long ndeques, long long nchunks)
+{
+    struct chunkdeque *deques = aligned_alloc(_Alignof(struct chunkdeque),
+                                              ndeques * sizeof *deques);
+    if (NULL == deques)
+        return NULL;
+
+    for (long long i = 0; i < ndeques; i++) {
+        pthread_mutex_init(&deques[i].lock, NULL);
+        deques[i].head = nchunks * i / ndeques;
+        deques[i].tail = nchunks * (i + 1) / ndeques;
+    }
+    return deques;
+}
+
+static void integrate_worker(void *ctx, long long id)
+{
+    struct fixed_job *job = ctx;
+
+    log("Worker #%lld starts with chunks [%lld; %lld)", id, job->deques[id].head,
+        job->deques[id].tail);
+
+    for (long long chunk; deque_next(job->deques, job->ndeques, id, &chunk);)
+        fixed_chunk(job, chunk, &job->sums[chunk * job->nout]);
+}
+
+
+// Integrate several functions over the same grid in a single pass: every block of
+// points is generated once and evaluated by all of them, and threads, chunks and
+// stealing are shared. res gets a result per output of every function
+static enum error integrate_fused(struct pool *pool, const struct integ_params *args,
+                                  const struct integrand *const *funcs, int nfuncs,
+                                  struct integ_result *res)
+{
+    enum error err = PE_OK;
+    long long nworkers = pool->nthreads;
+    struct fixed_job job = fixed_job_init(args, funcs, nfuncs);
+    long long nchunks = job.nchunks;
+    job.ndeques = nworkers;
+
+    job.sums = calloc(nchunks * job.nout, sizeof *job.sums);
+    except(NULL == job.sums, PE_MALLOC, err, sums_exc);
+
+    job.deques = deques_create(nworkers, nchunks);
+    except(NULL == job.deques, PE_MALLOC, err, deques_exc);
+
+    log("%lld chunks of %lld steps for %lld workers", nchunks, job.chunksteps, nworkers);
+
+    pool_run(pool, &integrate_worker, &job);
+
+    farg_t sums[MAX_FUSED], sumerrs[MAX_FUSED] = { .0 };
+    for (int o = 0; o < job.nout; o++) {
+        sums[o] = .0;
+        for (long long i = 0; i < nchunks; i++)
+            kahan_add(&sums[o], &sumerrs[o], job.sums[i * job.nout + o]);
+    }
+
+    fixed_finish(&job, sums, res);
+
+    free(job.deques);
+deques_exc:
+    free(job.sums);
+sums_exc:
+    return err;
+}
+
+static enum error integrate_fixed(struct pool *pool, const struct integ_params *args,
+                                  const struct integrand *func, struct integ_result *res)
+{
+    return integrate_fused(pool, args, &func, 1, res);
+}
+
+
+// Same as integrate_fixed() but on the calling thread. Used for small jobs where
+// handing chunks to other threads costs more than the work itself.
+// Chunks are the same, so is the result
+static struct integ_result integrate_fixed_serial(const struct integ_params *args,
+                                            const struct integrand *func)
+{
+    struct fixed_job job = fixed_job_init(args, &func, 1);
+
+    farg_t sum = .0, sumerr = .0;
+    for (long long i = 0; i < job.nchunks; i++) {
+        farg_t chunksum;
+        fixed_chunk(&job, i, &chunksum);
+        kahan_add(&sum, &sumerr, chunksum);
+    }
+
+    struct integ_result res;
+    fixed_finish(&job, &sum, &res);
+    return res;
+}
+
+
+// Parameter sweep.
+// Integrals for all values of the parameter are computed by a single pool_run():
+// chunk c is chunk c % nchunks of the integral c / nchunks, and all of them are
+// taken and stolen from the same deques. So however small every integral is, the
+// workers have nparams * nchunks chunks to share. Chunks are sized for the whole
+// sweep, as if it was a single grid of nparams * nsteps steps, and the sums of
+// every integral are added in the chunk order, so the result does not depend on
+// the number of threads
+struct sweep_job {
+    struct fixed_job *jobs;       // one per parameter value
+    long long nparams;
+    long long nchunks;            // of every integral
+    struct chunkdeque *deques;    // one per worker
+    long long ndeques;
+    farg_t *sums;                 // nchunks per parameter value
+};
+
+static void sweep_worker(void *ctx, long long id)
+{
+    struct sweep_job *sweep = ctx;
+    for (long long chunk; deque_next(sweep->deques, sweep->ndeques, id, &chunk);)
+        fixed_chunk(&sweep->jobs[chunk / sweep->nchunks], chunk % sweep->nchunks,
+                    &sweep->sums[chunk]);
+}
+
+static enum error integrate_sweep(struct pool *pool, const struct integ_params *args,
+                                  const struct integrand *func, struct integ_result *res)
+{
+    enum error err = PE_OK;
+    struct integ_params chunked = *args;
+    if (0 == chunked.chunksteps) {
+        // not larger than an integral though, the product may not fit either
+        long double total = (long double)args->nsteps * args->nparams / MAX_AUTO_CHUNKS;
+        chunked.chunksteps = (total < args->nsteps) ? (long long)total : args->nsteps;
+        if (chunked.chunksteps < MIN_AUTO_CHUNK)
+            chunked.chunksteps = MIN_AUTO_CHUNK;
+    }
+
+    struct sweep_job sweep = { .nparams = args->nparams, .ndeques = pool->nthreads };
+    sweep.jobs = malloc(sweep.nparams * sizeof *sweep.jobs);
+    except(NULL == sweep.jobs, PE_MALLOC, err, jobs_exc);
+
+    for (long long p = 0; p < sweep.nparams; p++) {
+        sweep.jobs[p] = fixed_job_init(&chunked, &func, 1);
+        sweep.jobs[p].param = args->param +
+                              (args->paramend - args->param) * p / (sweep.nparams - 1);
+    }
+    sweep.nchunks = sweep.jobs[0].nchunks;
+
+    sweep.sums = calloc(sweep.nparams * sweep.nchunks, sizeof *sweep.sums);
+    except(NULL == sweep.sums, PE_MALLOC, err, sums_exc);
+
+    sweep.deques = deques_create(sweep.ndeques, sweep.nparams * sweep.nchunks);
+    except(NULL == sweep.deques, PE_MALLOC, err, deques_exc);
+
+    log("%lld integrals of %lld chunks of %lld steps", sweep.nparams, sweep.nchunks,
+        sweep.jobs[0].chunksteps);
+
+    pool_run(pool, &sweep_worker, &sweep);
+
+    for (long long p = 0; p < sweep.nparams; p++) {
+        farg_t sum = .0, sumerr = .0;
+        for (long long i = 0; i < sweep.nchunks; i++)
+            kahan_add(&sum, &sumerr, sweep.sums[p * sweep.nchunks + i]);
+        fixed_finish(&sweep.jobs[p], &sum, &res[p]);
+    }
+
+    free(sweep.deques);
+deques_exc:
+    free(sweep.sums);
+sums_exc:
+    free(sweep.jobs);
+jobs_exc:
+    return err;
+}
+
+
+// Progressive Romberg.
+// Trapezoid sums with 1, 2, 4, ... steps are computed one after another, and every
+// next one reuses all points of the previous: T(2n) = (T(n) + M(n)) / 2, where M(n)
+// is the midpoint sum over the same n steps, i.e. at the new points only. So level
+// k costs as much as all previous levels together, and the whole run costs as much
+// as a single trapezoid sum with the final step. Midpoint sums are computed by
+// integrate_fixed(), with all its threads and work stealing.
+// Richardson extrapolation of the trapezoid sums removes error terms h^2, h^4, ...
+// one by one, and the change of the extrapolated value between levels estimates
+// its error.
+#define ROMBERG_MAX_LEVELS 62
+// do not trust agreement of a few coarse levels, e.g. sin(x) over [0; 2 pi]
+#define ROMBERG_MIN_LEVELS 4
+// relative agreement which is enough when -e is not given
+#define ROMBERG_RTOL 1e-13
+
+static enum error integrate_romberg(struct pool *pool, const struct integ_params *args,
+                                    const struct integrand *func, struct integ_result *res)
+{
+    enum error err = PE_OK;
+    struct timespec tstart, tnow;
+    clock_gettime(CLOCK_MONOTONIC, &tstart);
+
+    // only two rows of the Romberg table are needed
+    farg_t prev[ROMBERG_MAX_LEVELS + 1], cur[ROMBERG_MAX_LEVELS + 1];
+    farg_t width = args->end - args->start;
+    farg_t ends[] = { args->start, args->end }, fends[2];
+    integrand_eval(func, ends, fends, 2);
+    cur[0] = width * (fends[0] + fends[1]) / 2;
+    *res = (struct integ_result){ .value = cur[0], .errest = INFINITY, .nevals = 2 };
+
+    struct integ_params midargs = *args;
+    midargs.rule = integ_rule("midpoint");
+    midargs.chunksteps = 0;    // picked for every level
+    long long lastlevel_ns = 0;
+    const char *stopped = "steps limit";
+
+    for (int k = 1; (k <= ROMBERG_MAX_LEVELS) && (1LL << k) <= args->nsteps; k++) {
+        memcpy(prev, cur, k * sizeof *cur);
+
+        // midpoint sum over the 2^(k-1) steps of the previous level
+        struct integ_result mid;
+        midargs.nsteps = 1LL << (k - 1);
+        err = integrate_fixed(pool, &midargs, func, &mid);
+        except(PE_OK != err, err, err, level_exc);
+        res->nevals += mid.nevals;
+
+        cur[0] = (prev[0] + mid.value) / 2;
+        farg_t factor = 1.;
+        for (int j = 1; j <= k; j++) {
+            factor *= 4;
+            cur[j] = cur[j - 1] + (cur[j - 1] - prev[j - 1]) / (factor - 1);
+        }
+
+        res->value = cur[k];
+        res->errest = fabs(cur[k] - prev[k - 1]);
+
+        clock_gettime(CLOCK_MONOTONIC, &tnow);
+        long long elapsed_ns = diff_ns(tstart, tnow);
+        long long level_ns = elapsed_ns - lastlevel_ns;
+        lastlevel_ns = elapsed_ns;
+
+        if (NULL != args->trace) {
+            fprintf(args->trace, "Romberg level %d: %lld steps, estimate %.*Lg, change %.3Lg\n",
+                    k, 1LL << k, RESULT_DIGITS, (long double)res->value,
+                    (long double)res->errest);
+        }
+
+        farg_t tolerance = fmax(args->tolerance, ROMBERG_RTOL * fabs(res->value));
+        if ((k >= ROMBERG_MIN_LEVELS) && (res->errest <= tolerance)) {
+            stopped = NULL;
+            break;
+        }
+        // the next level takes about twice as long as this one
+        if ((args->budget > 0) && (elapsed_ns + 2 * level_ns > args->budget * 1e9)) {
+            stopped = "time budget";
+            break;
+        }
+    }
+
+    if ((NULL != args->trace) && (NULL != stopped))
+        fprintf(args->trace, "Romberg stopped by the %s before convergence\n", stopped);
+
+level_exc:
+    return err;
+}
+
+
+// Adaptive quadrature.
+// Each segment is integrated with the 15 points Kronrod rule, and the embedded 7 points
+// Gauss rule (which reuses every second Kronrod node) gives the error estimate for free.
+// Workers share a max-heap of segments ordered by their error estimate, repeatedly take
+// the worst one, bisect it and put both halves back until the total estimate is small enough.
+// Nodes and weights are the ones from QUADPACK (qk15.f), only positive half of the symmetric
+// rule is stored. Gauss weights correspond to odd Kronrod nodes.
+#define GK_NODES 15
+
+static const farg_t GK_XK[] = {
+    0.991455371120812639206854697526329, 0.949107912342758524526189684047851,
+    0.864864423359769072789712788640926, 0.741531185599394439863864773280788,
+    0.586087235467691130294144845693013, 0.405845151377397166906606412076961,
+    0.207784955007898467600689403773245, 0.000000000000000000000000000000000
+};
+
+static const farg_t GK_WK[] = {
+    0.022935322010529224963732008058970, 0.063092092629978553290700663189204,
+    0.104790010322250183839876322541518, 0.140653259715525918745189590510238,
+    0.169004726639267902826583426598550, 0.190350578064785409913256402421014,
+    0.204432940075298892414161999234649, 0.209482141084727828012999174891714
+};
+
+static const farg_t GK_WG[] = {
+    0.129484966168869693270611432679082, 0.279705391489276667901467771423780,
+    0.381830050505118944950369775488975, 0.417959183673469387755102040816327
+};
+
+
+struct segment {
+    farg_t a, b;
+    farg_t value;
+    farg_t errest;
+};
+
+// Fill 15 nodes of segment [a; b] to xs
+static void gk_nodes(farg_t a, farg_t b, farg_t *xs)
+{
+    farg_t center = (a + b) / 2, half = (b - a) / 2;
+    for (int i = 0; i < 7; i++) {
+        xs[2 * i] = center - half * GK_XK[i];
+        xs[2 * i + 1] = center + half * GK_XK[i];
+    }
+    xs[GK_NODES - 1] = center;
+}
+
+// Apply both rules to the function values at gk_nodes()
+static struct segment gk_apply(farg_t a, farg_t b, const farg_t *ys)
+{
+    farg_t half = (b - a) / 2;
+    farg_t kronrod = GK_WK[7] * ys[GK_NODES - 1];
+    farg_t gauss = GK_WG[3] * ys[GK_NODES - 1];
+    for (int i = 0; i < 7; i++) {
+        farg_t pair = ys[2 * i] + ys[2 * i + 1];
+        kronrod += GK_WK[i] * pair;
+        if (i % 2)
+            gauss += GK_WG[i / 2] * pair;
+    }
+
+    // |K - G| is a pessimistic estimate: the actual error of K is usually much smaller
+    return (struct segment){ .a = a, .b = b,
+                             .value = kronrod * half,
+                             .errest = fabs((kronrod - gauss) * half) };
+}
+
+
+// Binary max-heap of segments keyed by the error estimate
+struct segheap {
+    struct segment *items;
+    size_t len;
+    size_t cap;
+};
+
+static bool segheap_push(struct segheap *heap, struct segment seg)
+{
+    if (heap->len == heap->cap) {
+        size_t cap = heap->cap ? 2 * heap->cap : 64;
+        struct segment *items = realloc(heap->items, cap * sizeof *items);
+        if (NULL == items)
+            return false;
+        heap->items = items;
+        heap->cap = cap;
+    }
+
+    size_t i = heap->len++;
+    while (i > 0 && heap->items[(i - 1) / 2].errest < seg.errest) {
+        heap->items[i] = heap->items[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    heap->items[i] = seg;
+    return true;
+}
+
+static struct segment segheap_pop(struct segheap *heap)
+{
+    struct segment top = heap->items[0];
+    struct segment last = heap->items[--heap->len];
+
+    size_t i = 0;
+    for (size_t child; (child = 2 * i + 1) < heap->len; i = child) {
+        if (child + 1 < heap->len && heap->items[child + 1].errest > heap->items[child].errest)
+            child++;
+        if (heap->items[child].errest <= last.errest)
+            break;
+        heap->items[i] = heap->items[child];
+    }
+    heap->items[i] = last;
+    return top;
+}
+
+
+// Shared between adaptive workers, guarded by the lock
+struct adaptive_state {
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    struct segheap heap;
+    farg_t value;         // running totals over all segments, including
+    farg_t errest;        // ones being refined at the moment
+    long long nevals;
+    long long nbusy;      // workers refining a segment right now
+    farg_t tolerance;
+    long long maxsegments;
+    const struct integrand *func;
+    enum error err;
+    bool isdone;
+};
+
+static void adaptive_worker(void *ctx, long long id)
+{
+    struct adaptive_state *st = ctx;
+    farg_t xs[2 * GK_NODES], ys[2 * GK_NODES];
+
+    pthread_mutex_lock(&st->lock);
+    for (;;) {
+        // when the heap is empty others are refining, so wait for their halves
+        while (!st->isdone && (0 == st->heap.len) && st->nbusy)
+            pthread_cond_wait(&st->changed, &st->lock);
+
+        if (st->isdone)
+            break;
+
+        if ((st->errest <= st->tolerance) || (0 == st->heap.len)) {
+            st->isdone = true;
+            break;
+        }
+
+        struct segment seg = segheap_pop(&st->heap);
+        farg_t mid = (seg.a + seg.b) / 2;
+
+        // Bisection is not possible anymore or we are out of our memory budget.
+        // Put the segment back so that totals stay consistent
+        if ((mid <= seg.a) || (mid >= seg.b) ||
+            ((long long)st->heap.len + st->nbusy + 2 > st->maxsegments)) {
+            segheap_push(&st->heap, seg);
+            st->err = PE_CVGERR;
+            st->isdone = true;
+            break;
+        }
+
+        st->nbusy++;
+        pthread_mutex_unlock(&st->lock);
+
+        // both halves are evaluated with a single call
+        gk_nodes(seg.a, mid, xs);
+        gk_nodes(mid, seg.b, xs + GK_NODES);
+        integrand_eval(st->func, xs, ys, 2 * GK_NODES);
+        struct segment left = gk_apply(seg.a, mid, ys);
+        struct segment right = gk_apply(mid, seg.b, ys + GK_NODES);
+
+        pthread_mutex_lock(&st->lock);
+        st->nbusy--;
+        st->nevals += 2 * GK_NODES;
+        st->value += left.value + right.value - seg.value;
+        st->errest += left.errest + right.errest - seg.errest;
+        if (!segheap_push(&st->heap, left) || !segheap_push(&st->heap, right)) {
+            st->err = PE_MALLOC;
+            st->isdone = true;
+        }
+        pthread_cond_broadcast(&st->changed);
+    }
+
+    // wake up everyone who waits for segments which will never come
+    pthread_cond_broadcast(&st->changed);
+    pthread_mutex_unlock(&st->lock);
+    log("Worker #%lld is done", id);
+}
+
+
+static enum error integrate_adaptive(struct pool *pool, const struct integ_params *args,
+                                     const struct integrand *func, struct integ_result *res)
+{
+    struct adaptive_state st = {
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .changed = PTHREAD_COND_INITIALIZER,
+        .tolerance = args->tolerance,
+        .maxsegments = args->maxsegments,
+        .func = func,
+        .err = PE_OK
+    };
+    enum error err = PE_OK;
+
+    // Start with one segment per thread so everyone has some work right away
+    farg_t part = (args->end - args->start) / pool->nthreads;
+    for (long long i = 0; i < pool->nthreads; i++) {
+        farg_t a = args->start + part * i;
+        farg_t b = (i == pool->nthreads - 1) ? args->end : a + part;
+        farg_t xs[GK_NODES], ys[GK_NODES];
+
+        gk_nodes(a, b, xs);
+        integrand_eval(func, xs, ys, GK_NODES);
+        struct segment seg = gk_apply(a, b, ys);
+
+        except(!segheap_push(&st.heap, seg), PE_MALLOC, err, heap_exc);
+        st.value += seg.value;
+        st.errest += seg.errest;
+        st.nevals += GK_NODES;
+    }
+
+    pool_run(pool, &adaptive_worker, &st);
+    err = st.err;
+
+    // running totals accumulate rounding errors of the updates, so sum up from scratch
+    farg_t value = .0, errest = .0;
+    for (size_t i = 0; i < st.heap.len; i++) {
+        value += st.heap.items[i].value;
+        errest += st.heap.items[i].errest;
+    }
+
+    log("Adaptive run finished with %zu segments", st.heap.len);
+    *res = (struct integ_result){ .value = value, .errest = errest, .nevals = st.nevals };
+
+heap_exc:
+    free(st.heap.items);
+    return err;
+}
+
+
+// Sampling methods.
+// Monte Carlo estimates the integral over a box as its volume times the mean of f
+// over random points, and the standard error comes from the sample variance.
+// Sobol points fill the box a lot more evenly, so the error decreases almost as
+// 1/n instead of 1/sqrt(n), but there is no variance to estimate it from. Then
+// SOBOL_REPLICAS copies of the sequence are XORed with independent random shifts,
+// which keeps their evenness, and the spread of the replica means gives the error.
+//
+// Points are generated in blocks of MC_BLOCK which are the chunks for work stealing.
+// A block has its own generator seeded with the seed and the block number (Sobol
+// points are computed from their index anyway), and the moments of blocks are merged
+// in the block order. So the result depends neither on threads nor on stealing.
+#define SOBOL_BITS 32
+// Points of a replica are indexed with SOBOL_BITS bits
+#define SOBOL_MAX_POINTS ((1LL << SOBOL_BITS) - 1)
+
+// Primitive polynomials and initial direction numbers from Joe and Kuo
+// (new-joe-kuo-6.21201) for dimensions 2 and up. The first one is van der Corput
+struct sobol_poly {
+    int degree;
+    unsigned coeffs;
+    unsigned m[7];
+};
+
+static const struct sobol_poly SOBOL_POLYS[MC_MAX_DIM - 1] = {
+    { 1, 0, { 1 } },
+    { 2, 1, { 1, 3 } },
+    { 3, 1, { 1, 3, 1 } },
+    { 3, 2, { 1, 1, 1 } },
+    { 4, 1, { 1, 1, 3, 3 } },
+    { 4, 4, { 1, 3, 5, 13 } },
+    { 5, 2, { 1, 1, 5, 5, 17 } },
+    { 5, 4, { 1, 1, 5, 5, 5 } },
+    { 5, 7, { 1, 1, 7, 11, 19 } },
+    { 5, 11, { 1, 1, 5, 1, 1 } },
+    { 5, 13, { 1, 1, 1, 3, 11 } },
+    { 5, 14, { 1, 3, 5, 5, 31 } },
+    { 6, 1, { 1, 3, 3, 9, 7, 49 } },
+    { 6, 13, { 1, 1, 1, 15, 21, 21 } },
+    { 6, 16, { 1, 3, 1, 13, 27, 49 } },
+    { 6, 19, { 1, 1, 1, 15, 7, 5 } },
+    { 6, 22, { 1, 3, 1, 15, 13, 25 } },
+    { 6, 25, { 1, 1, 5, 5, 19, 61 } },
+    { 7, 1, { 1, 3, 7, 11, 23, 15, 103 } },
+    { 7, 4, { 1, 3, 7, 13, 13, 15, 69 } },
+};
+
+
+// SplitMix64 finalizer: a good 64 bit hash, used to seed generators
+static inline uint64_t mix64(uint64_t z)
+{
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+// xoshiro256** by Blackman and Vigna: fast, small state, good statistics
+struct xoshiro {
+    uint64_t s[4];
+};
+
+static inline uint64_t rotl64(uint64_t x, int k)
+{
+    return (x << k) | (x >> (64 - k));
+}
+
+static inline uint64_t xoshiro_next(struct xoshiro *g)
+{
+    uint64_t result = rotl64(g->s[1] * 5, 7) * 9;
+    uint64_t t = g->s[1] << 17;
+    g->s[2] ^= g->s[0];
+    g->s[3] ^= g->s[1];
+    g->s[1] ^= g->s[2];
+    g->s[0] ^= g->s[3];
+    g->s[2] ^= t;
+    g->s[3] = rotl64(g->s[3], 45);
+    return result;
+}
+
+// Generator of the given stream, e.g. a block number. Streams start at unrelated
+// points of the period, so they do not overlap in practice
+static struct xoshiro xoshiro_seed(uint64_t seed, uint64_t stream)
+{
+    struct xoshiro g;
+    uint64_t state = mix64(seed) + stream;
+    for (int i = 0; i < 4; i++)
+        g.s[i] = mix64(state = mix64(state) + i + 1);
+    return g;
+}
+
+// Uniform in [0; 1) with all 53 bits random
+static inline farg_t xoshiro_uniform(struct xoshiro *g)
+{
+    return (xoshiro_next(g) >> 11) * 0x1p-53;
+}
+
+
+// Count, mean and sum of squared deviations. Merged with the Chan et al. formula,
+// which does not lose precision as sum of squares minus squared sum does
+struct moments {
+    long long n;
+    farg_t mean;
+    farg_t m2;
+};
+
+static struct moments moments_merge(struct moments a, struct moments b)
+{
+    long long n = a.n + b.n;
+    if (0 == n)
+        return a;
+    farg_t delta = b.mean - a.mean;
+    return (struct moments){
+        .n = n,
+        .mean = a.mean + delta * b.n / n,
+        .m2 = a.m2 + b.m2 + delta * delta * a.n / n * b.n
+    };
+}
+
+
+struct sampling_job {
+    const struct integrand *func;
+    enum sampling sampling;
+    unsigned ndim;
+    farg_t lower[MC_MAX_DIM];
+    farg_t width[MC_MAX_DIM];
+    uint64_t seed;
+    long long npoints;       // per replica
+    long long nreplicas;
+    long long nblocks;       // per replica
+    long long nchunks;       // blocks of all replicas
+    uint32_t directions[MC_MAX_DIM][SOBOL_BITS];
+    uint32_t shifts[SOBOL_REPLICAS][MC_MAX_DIM];
+    struct chunkdeque *deques;
+    long long ndeques;
+    struct moments *moments;    // one per chunk
+};
+
+static void sobol_init(struct sampling_job *job)
+{
+    for (int k = 0; k < SOBOL_BITS; k++)
+        job->directions[0][k] = 1U << (SOBOL_BITS - 1 - k);
+
+    for (unsigned d = 1; d < job->ndim; d++) {
+        const struct sobol_poly *poly = &SOBOL_POLYS[d - 1];
+        uint32_t *v = job->directions[d];
+        int s = poly->degree;
+        for (int k = 0; k < SOBOL_BITS; k++) {
+            if (k < s) {
+                v[k] = poly->m[k] << (SOBOL_BITS - 1 - k);
+                continue;
+            }
+            v[k] = v[k - s] ^ (v[k - s] >> s);
+            for (int i = 1; i < s; i++) {
+                if ((poly->coeffs >> (s - 1 - i)) & 1)
+                    v[k] ^= v[k - i];
+            }
+        }
+    }
+
+    // independent of the block streams, which are numbered from 0
+    for (int r = 0; r < SOBOL_REPLICAS; r++) {
+        struct xoshiro g = xoshiro_seed(job->seed, -1ULL - r);
+        for (unsigned d = 0; d < job->ndim; d++)
+            job->shifts[r][d] = xoshiro_next(&g) >> 32;
+    }
+}
+
+// Evaluate the function at n points of ndim coordinates each
+static void sampling_eval(const struct integrand *f, unsigned ndim, const farg_t *restrict xs,
+                          farg_t *restrict ys, size_t n)
+{
+    if (f->ndbatch) {
+        thread_nevals += n;
+        f->ndbatch(xs, ys, n, ndim);
+    } else if (f->ndfunc) {
+        thread_nevals += n;
+        for (size_t i = 0; i < n; i++)
+            ys[i] = f->ndfunc(&xs[i * ndim], ndim);
+    } else {
+        // a one-dimensional function, see integrand_check()
+        integrand_eval(f, xs, ys, n);
+    }
+}
+
+static struct moments sampling_chunk(const struct sampling_job *job, long long chunk)
+{
+    long long replica = chunk / job->nblocks;
+    long long first = chunk % job->nblocks * MC_BLOCK;
+    long long last = (first + MC_BLOCK < job->npoints) ? first + MC_BLOCK : job->npoints;
+    unsigned ndim = job->ndim;
+    bool issobol = (SAMPLING_SOBOL == job->sampling);
+
+    farg_t xs[BATCH_SIZE * MC_MAX_DIM], ys[MC_BLOCK];
+    struct xoshiro g = xoshiro_seed(job->seed, chunk);
+    uint32_t point[MC_MAX_DIM] = { 0 };
+    const uint32_t *shift = job->shifts[replica];
+
+    if (issobol) {
+        // Points go in the Gray code order, so the next one differs from the previous
+        // by a single direction number. The first one is computed from its index
+        uint64_t gray = first ^ (first >> 1);
+        for (int k = 0; k < SOBOL_BITS; k++) {
+            if (!((gray >> k) & 1))
+                continue;
+            for (unsigned d = 0; d < ndim; d++)
+                point[d] ^= job->directions[d][k];
+        }
+    }
+
+    for (long long i = first; i < last; i += BATCH_SIZE) {
+        size_t n = (last - i < BATCH_SIZE) ? last - i : BATCH_SIZE;
+        for (size_t k = 0; k < n; k++) {
+            farg_t *x = &xs[k * ndim];
+            if (issobol) {
+                for (unsigned d = 0; d < ndim; d++)
+                    x[d] = job->lower[d] + job->width[d] * ((point[d] ^ shift[d]) * 0x1p-32);
+                int bit = __builtin_ctzll(i + k + 1);
+                for (unsigned d = 0; d < ndim; d++)
+                    point[d] ^= job->directions[d][bit];
+            } else {
+                for (unsigned d = 0; d < ndim; d++)
+                    x[d] = job->lower[d] + job->width[d] * xoshiro_uniform(&g);
+            }
+        }
+        sampling_eval(job->func, ndim, xs, &ys[i - first], n);
+    }
+
+    // two passes over the block are exact enough, mean first
+    long long n = last - first;
+    farg_t mean = block_sum(ys, n) / n;
+    for (long long k = 0; k < n; k++)
+        ys[k] = (ys[k] - mean) * (ys[k] - mean);
+    return (struct moments){ .n = n, .mean = mean, .m2 = block_sum(ys, n) };
+}
+
+static void sampling_worker(void *ctx, long long id)
+{
+    struct sampling_job *job = ctx;
+    for (long long chunk; deque_next(job->deques, job->ndeques, id, &chunk);)
+        job->moments[chunk] = sampling_chunk(job, chunk);
+}
+
+static enum error integrate_sampling(struct pool *pool, const struct integ_params *args,
+                                     const struct integrand *func, struct integ_result *res)
+{
+    enum error err = PE_OK;
+
+    struct sampling_job *job = calloc(1, sizeof *job);
+    except(NULL == job, PE_MALLOC, err, job_exc);
+
+    job->func = func;
+    job->sampling = args->sampling;
+    job->ndim = args->ndim;
+    job->seed = args->seed;
+    job->nreplicas = (SAMPLING_SOBOL == args->sampling) ? SOBOL_REPLICAS : 1;
+    job->npoints = (args->nsteps + job->nreplicas - 1) / job->nreplicas;
+    if ((SAMPLING_SOBOL == args->sampling) && (job->npoints > SOBOL_MAX_POINTS))
+        job->npoints = SOBOL_MAX_POINTS;
+    job->nblocks = (job->npoints + MC_BLOCK - 1) / MC_BLOCK;
+    job->nchunks = job->nblocks * job->nreplicas;
+    job->ndeques = pool->nthreads;
+
+    farg_t volume = 1.;
+    for (unsigned d = 0; d < job->ndim; d++) {
+        job->lower[d] = args->box ? args->box[2 * d] : args->start;
+        job->width[d] = (args->box ? args->box[2 * d + 1] : args->end) - job->lower[d];
+        volume *= job->width[d];
+    }
+    if (SAMPLING_SOBOL == args->sampling)
+        sobol_init(job);
+
+    job->moments = calloc(job->nchunks, sizeof *job->moments);
+    except(NULL == job->moments, PE_MALLOC, err, moments_exc);
+
+    job->deques = deques_create(job->ndeques, job->nchunks);
+    except(NULL == job->deques, PE_MALLOC, err, deques_exc);
+
+    log("%lld replicas of %lld points in %lld dimensions", job->nreplicas, job->npoints,
+        (long long)job->ndim);
+
+    pool_run(pool, &sampling_worker, job);
+
+    // mean and its variance for every replica
+    farg_t means[SOBOL_REPLICAS], variances[SOBOL_REPLICAS];
+    for (long long r = 0; r < job->nreplicas; r++) {
+        struct moments m = { 0 };
+        for (long long i = 0; i < job->nblocks; i++)
+            m = moments_merge(m, job->moments[r * job->nblocks + i]);
+        means[r] = m.mean;
+        variances[r] = (m.n > 1) ? m.m2 / (m.n - 1) / m.n : 0.;
+    }
+
+    if (1 == job->nreplicas) {
+        res->value = volume * means[0];
+        res->errest = volume * sqrt(variances[0]);
+    } else {
+        farg_t mean = 0., m2 = 0.;
+        for (long long r = 0; r < job->nreplicas; r++)
+            mean += means[r] / job->nreplicas;
+        for (long long r = 0; r < job->nreplicas; r++)
+            m2 += (means[r] - mean) * (means[r] - mean);
+        res->value = volume * mean;
+        res->errest = volume * sqrt(m2 / (job->nreplicas - 1) / job->nreplicas);
+    }
+    res->nevals = job->npoints * job->nreplicas;
+
+    free(job->deques);
+deques_exc:
+    free(job->moments);
+moments_exc:
+    free(job);
+job_exc:
+    return err;
+}
+
+
+// Result cache.
+// A file mapped into memory with MAP_SHARED holds a hash table of results, so
+// identical integrals are computed once across runs and processes. The key is a
+// 128 bit hash of everything that affects the result: contents of the library
+// (or the -E expression), interval, steps, method, precision and so on. So a
+// rebuilt library simply gets other keys, and its stale results are evicted.
+// The table has a fixed number of slots, which bounds the file size. A key may
+// only be in one of CACHE_PROBES slots after its home slot; when all of them are
+// taken, the least recently used one is replaced.
+// Processes sharing the file serialize on flock(); within a process the cache
+// is only used by a single thread.
+#define CACHE_MAGIC "DLICACHE"
+#define CACHE_VERSION 1
+#define CACHE_PROBES 8
+
+struct cache_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t slotsize;
+    uint64_t nslots;
+    uint64_t clock;         // incremented on every use, for LRU
+} __attribute__((aligned(64)));
+
+struct cache_slot {
+    uint64_t key[2];        // 0 for an empty slot
+    farg_t value;
+    farg_t errest;
+    int64_t nevals;
+    uint64_t lastuse;
+} __attribute__((aligned(CACHE_SLOT_SIZE)));
+
+_Static_assert(sizeof(struct cache_slot) == CACHE_SLOT_SIZE, "cache slot size");
+
+struct cache {
+    int fd;
+    struct cache_header *header;
+    struct cache_slot *slots;
+    size_t size;
+    long long nhits;
+    long long nmisses;
+};
+
+// Hash of arbitrary bytes, mixing 8 bytes at a time
+static uint64_t hash64(const void *data, size_t len, uint64_t seed)
+{
+    const unsigned char *bytes = data;
+    uint64_t h = mix64(seed ^ len);
+    for (; len >= 8; bytes += 8, len -= 8) {
+        uint64_t word;
+        memcpy(&word, bytes, 8);
+        h = mix64(h ^ word) + 0x9e3779b97f4a7c15ULL;
+    }
+    uint64_t tail = 0;
+    memcpy(&tail, bytes, len);
+    return mix64(h ^ tail);
+}
+
+// Hash of the file contents, 0 if it can not be read
+static uint64_t hash_file(const char *path)
+{
+    uint64_t hash = 0;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if ((fd < 0) || fstat(fd, &st) || (0 == st.st_size)) {
+        if (fd >= 0)
+            close(fd);
+        return 0;
+    }
+
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (MAP_FAILED != data) {
+        hash = hash64(data, st.st_size, 0) ?: 1;
+        munmap(data, st.st_size);
+    }
+    close(fd);
+    return hash;
+}
+
+// Open or create the cache. nslots 0 keeps the size of an existing cache.
+// A file of another size or format is cleared
+static enum error cache_open(const char *path, long long nslots, struct cache *cache)
+{
+    enum error err = PE_OK;
+
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    except(fd < 0, PE_CACHE, err, open_exc);
+    flock(fd, LOCK_EX);
+
+    struct stat st;
+    except(fstat(fd, &st), PE_CACHE, err, stat_exc);
+
+    struct cache_header old = { 0 };
+    if ((size_t)st.st_size >= sizeof old)
+        except(pread(fd, &old, sizeof old, 0) != sizeof old, PE_CACHE, err, stat_exc);
+
+    bool isvalid = !memcmp(old.magic, CACHE_MAGIC, sizeof old.magic) &&
+                   (CACHE_VERSION == old.version) &&
+                   (sizeof(struct cache_slot) == old.slotsize) &&
+                   ((size_t)st.st_size == sizeof old + old.nslots * sizeof(struct cache_slot));
+    if (isvalid && !nslots)
+        nslots = old.nslots;
+    nslots = nslots ?: CACHE_DEFAULT_SLOTS;
+    isvalid = isvalid && (old.nslots == (uint64_t)nslots);
+
+    size_t size = sizeof old + nslots * sizeof(struct cache_slot);
+    if (!isvalid) {
+        // truncating to 0 first zeroes all slots
+        except(ftruncate(fd, 0) || ftruncate(fd, size), PE_CACHE, err, stat_exc);
+        struct cache_header header = {
+            .magic = CACHE_MAGIC, .version = CACHE_VERSION,
+            .slotsize = sizeof(struct cache_slot), .nslots = nslots
+        };
+        except(pwrite(fd, &header, sizeof header, 0) != sizeof header, PE_CACHE, err, stat_exc);
+    }
+
+    void *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    except(MAP_FAILED == data, PE_CACHE, err, stat_exc);
+    flock(fd, LOCK_UN);
+
+    *cache = (struct cache){
+        .fd = fd,
+        .header = data,
+        .slots = (struct cache_slot *)((struct cache_header *)data + 1),
+        .size = size
+    };
+    return PE_OK;
+
+stat_exc:
+    close(fd);
+open_exc:
+    snprintf(errdetail, sizeof errdetail, "%s", path);
+    return err;
+}
+
+static void cache_close(struct cache *cache)
+{
+    munmap(cache->header, cache->size);
+    close(cache->fd);
+}
+
+// Key of the integral, false if the result can not be cached
+static bool cache_key(const struct integ_params *args, const struct integrand *func,
+                      uint64_t key[2])
+{
+    // a time budget makes the result depend on the machine load
+    if ((0 == func->id) || (args->isromberg && (args->budget > 0)))
+        return false;
+
+    // memset, so that padding does not get into the hash
+    struct {
+        uint64_t id;
+        farg_t start, end, tolerance;
+        long long nsteps, chunksteps, maxsegments, ndim;
+        unsigned long long seed;
+        int rule, sampling, precision, isromberg;
+        farg_t box[2 * MC_MAX_DIM];
+        farg_t param;               // of a single value, sweeps are not cached
+        long long nparams;
+    } fields;
+    memset(&fields, 0, sizeof fields);
+
+    fields.id = func->id;
+    fields.start = args->start;
+    fields.end = args->end;
+    fields.tolerance = args->tolerance;
+    fields.nsteps = args->nsteps;
+    fields.chunksteps = args->chunksteps;
+    fields.maxsegments = args->maxsegments;
+    fields.ndim = args->ndim;
+    fields.seed = args->seed;
+    fields.rule = args->rule - RULES;
+    fields.sampling = args->sampling;
+    fields.precision = args->precision;
+    fields.isromberg = args->isromberg;
+    if (args->box)
+        memcpy(fields.box, args->box, 2 * args->ndim * sizeof *args->box);
+    fields.param = args->param;
+    fields.nparams = args->nparams;
+
+    key[0] = hash64(&fields, sizeof fields, 1) ?: 1;    // 0 is an empty slot
+    key[1] = hash64(&fields, sizeof fields, 2);
+    return true;
+}
+
+static bool cache_lookup(struct cache *cache, const uint64_t key[2], struct integ_result *res)
+{
+    bool isfound = false;
+    flock(cache->fd, LOCK_EX);
+    uint64_t nslots = cache->header->nslots;
+    for (uint64_t i = 0; (i < CACHE_PROBES) && !isfound; i++) {
+        struct cache_slot *slot = &cache->slots[(key[0] + i) % nslots];
+        if (0 == slot->key[0])
+            break;
+        isfound = (slot->key[0] == key[0]) && (slot->key[1] == key[1]);
+        if (isfound) {
+            *res = (struct integ_result){
+                .value = slot->value, .errest = slot->errest, .nevals = slot->nevals
+            };
+            slot->lastuse = ++cache->header->clock;
+        }
+    }
+    flock(cache->fd, LOCK_UN);
+
+    if (isfound)
+        cache->nhits++;
+    else
+        cache->nmisses++;
+    return isfound;
+}
+
+static void cache_store(struct cache *cache, const uint64_t key[2], const struct integ_result *res)
+{
+    flock(cache->fd, LOCK_EX);
+    uint64_t nslots = cache->header->nslots;
+    struct cache_slot *victim = NULL;
+    for (uint64_t i = 0; i < CACHE_PROBES; i++) {
+        struct cache_slot *slot = &cache->slots[(key[0] + i) % nslots];
+        bool isfree = (0 == slot->key[0]) ||
+                      ((slot->key[0] == key[0]) && (slot->key[1] == key[1]));
+        if (isfree || (NULL == victim) || (slot->lastuse < victim->lastuse))
+            victim = slot;
+        if (isfree)
+            break;
+    }
+
+    *victim = (struct cache_slot){
+        .key = { key[0], key[1] },
+        .value = res->value,
+        .errest = res->errest,
+        .nevals = res->nevals,
+        .lastuse = ++cache->header->clock
+    };
+    flock(cache->fd, LOCK_UN);
+}
+
+
+// Sample files.
+// Workers go through a file in chunks with work stealing, the same way as through
+// a grid: tabulation evaluates the function right into the mapped file, and
+// integration adds up the mapped samples where they are. After a chunk its pages
+// are dropped from the process with MADV_DONTNEED: they stay in the page cache
+// (written ones are flushed by the kernel), and resident memory stays within a
+// chunk per worker however large the file is. Writeback of a tabulated chunk is
+// started right away, so dirty pages do not pile up either
+struct samples {
+    int fd;
+    void *map;                   // whole file
+    size_t size;
+    const farg_t *ys;            // count samples
+    long long count;
+    farg_t start;
+    farg_t end;
+};
+
+struct samples_job {
+    const struct integrand *func;    // tabulated
+    farg_t *ys;                      // written or read
+    int fd;                          // tabulated
+    enum { SAMPLES_LEFT, SAMPLES_TRAPEZOID, SAMPLES_SIMPSON } rule;
+    farg_t start;
+    farg_t step;
+    long long count;                 // samples tabulated or added up
+    long long chunksize;
+    long long nchunks;
+    struct chunkdeque *deques;       // one per worker
+    long long ndeques;
+    farg_t *sums;                    // even and odd samples of every chunk
+};
+
+// Chunks of the same size as for the grid of count steps, rounded up to whole
+// pages: the data starts at a page boundary, so chunks do not share pages
+static void samples_chunks(struct samples_job *job, long long chunksteps, long long count)
+{
+    long long pagesamples = getpagesize() / sizeof(farg_t);
+    job->count = count;
+    job->chunksize = chunksteps;
+    if (0 == job->chunksize) {
+        job->chunksize = count / MAX_AUTO_CHUNKS;
+        job->chunksize = (job->chunksize > MIN_AUTO_CHUNK) ? job->chunksize : MIN_AUTO_CHUNK;
+    }
+    job->chunksize = (job->chunksize + pagesamples - 1) / pagesamples * pagesamples;
+    job->nchunks = (count + job->chunksize - 1) / job->chunksize;
+}
+
+// Drop whole pages of [ptr; ptr + len) from the process. Partial ones are only
+// there with pages larger than SAMPLES_DATA_OFFSET, and are left alone
+static void samples_release(const void *ptr, size_t len)
+{
+    uintptr_t pagesize = getpagesize();
+    uintptr_t first = ((uintptr_t)ptr + pagesize - 1) & ~(pagesize - 1);
+    uintptr_t last = ((uintptr_t)ptr + len) & ~(pagesize - 1);
+    if (last > first)
+        madvise((void *)first, last - first, MADV_DONTNEED);
+}
+
+static void tabulate_worker(void *ctx, long long id)
+{
+    struct samples_job *job = ctx;
+    for (long long chunk; deque_next(job->deques, job->ndeques, id, &chunk);) {
+        long long first = chunk * job->chunksize;
+        long long last = (first + job->chunksize < job->count) ? first + job->chunksize
+                                                               : job->count;
+        // points from their index, same as integrate_chunk() does
+        farg_t xs[BATCH_SIZE];
+        for (long long i = first; i < last; i += BATCH_SIZE) {
+            size_t n = (last - i < BATCH_SIZE) ? last - i : BATCH_SIZE;
+            for (size_t k = 0; k < n; k++)
+                xs[k] = job->start + (i + (long long)k) * job->step;
+            integrand_eval(job->func, xs, &job->ys[i], n);
+        }
+
+        size_t len = (last - first) * sizeof *job->ys;
+        sync_file_range(job->fd, SAMPLES_DATA_OFFSET + first * sizeof *job->ys, len,
+                        SYNC_FILE_RANGE_WRITE);
+        samples_release(&job->ys[first], len);
+    }
+}
+
+// Write samples of func to path. The header goes last, so a file which has not
+// been completed is not valid
+static enum error tabulate(struct pool *pool, const struct integ_params *args,
+                           const struct integrand *func, const char *path,
+                           struct integ_result *res)
+{
+    enum error err = PE_OK;
+    struct samples_job job = {
+        .func = func,
+        .start = args->start,
+        .step = (args->end - args->start) / args->nsteps,
+        .ndeques = pool->nthreads
+    };
+    samples_chunks(&job, args->chunksteps, args->nsteps + 1);
+    size_t size = SAMPLES_DATA_OFFSET + job.count * sizeof *job.ys;
+
+    job.fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    except(job.fd < 0, PE_SAMPLES, err, open_exc);
+
+    // Blocks are allocated up front where the file system can, so that running
+    // out of space is an error here rather than SIGBUS in a worker
+    int ret = fallocate(job.fd, 0, 0, size);
+    if (ret && (EOPNOTSUPP == errno))
+        ret = ftruncate(job.fd, size);
+    except(ret, PE_SAMPLES, err, map_exc);
+
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, job.fd, 0);
+    except(MAP_FAILED == map, PE_SAMPLES, err, map_exc);
+    job.ys = (farg_t *)((char *)map + SAMPLES_DATA_OFFSET);
+
+    job.deques = deques_create(job.ndeques, job.nchunks);
+    except(NULL == job.deques, PE_MALLOC, err, deques_exc);
+
+    log("%lld samples in %lld chunks to '%s'", job.count, job.nchunks, path);
+
+    pool_run(pool, &tabulate_worker, &job);
+
+    struct samples_header header = {
+        .magic = SAMPLES_MAGIC, .version = SAMPLES_VERSION,
+        .samplesize = sizeof *job.ys, .count = job.count,
+        .start = args->start, .end = job.start + (job.count - 1) * job.step
+    };
+    bool iswritten = (pwrite(job.fd, &header, sizeof header, 0) == sizeof header);
+    except(!iswritten, PE_SAMPLES, err, write_exc);
+    *res = (struct integ_result){ .nevals = job.count };
+
+write_exc:
+    free(job.deques);
+deques_exc:
+    munmap(map, size);
+map_exc:
+    close(job.fd);
+open_exc:
+    if (PE_SAMPLES == err)
+        snprintf(errdetail, sizeof errdetail, "%s", path);
+    return err;
+}
+
+static enum error samples_open(const char *path, struct samples *samples)
+{
+    enum error err = PE_OK;
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    except(fd < 0, PE_SAMPLES, err, open_exc);
+
+    struct stat st;
+    struct samples_header header = { 0 };
+    except(fstat(fd, &st) || ((size_t)st.st_size < SAMPLES_DATA_OFFSET), PE_SAMPLES, err,
+           header_exc);
+    except(pread(fd, &header, sizeof header, 0) != sizeof header, PE_SAMPLES, err, header_exc);
+
+    bool isvalid = !memcmp(header.magic, SAMPLES_MAGIC, sizeof header.magic) &&
+                   (SAMPLES_VERSION == header.version) &&
+                   (sizeof(farg_t) == header.samplesize) && (header.count >= 2) &&
+                   ((size_t)st.st_size == SAMPLES_DATA_OFFSET + header.count * sizeof(farg_t)) &&
+                   (header.end > header.start);
+    except(!isvalid, PE_SAMPLES, err, header_exc);
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    except(MAP_FAILED == map, PE_SAMPLES, err, header_exc);
+    // every worker reads its chunks one after another
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+    *samples = (struct samples){
+        .fd = fd,
+        .map = map,
+        .size = st.st_size,
+        .ys = (const farg_t *)((const char *)map + SAMPLES_DATA_OFFSET),
+        .count = header.count,
+        .start = header.start,
+        .end = header.end
+    };
+    return PE_OK;
+
+header_exc:
+    close(fd);
+open_exc:
+    snprintf(errdetail, sizeof errdetail, "%s", path);
+    return err;
+}
+
+static void samples_close(struct samples *samples)
+{
+    munmap(samples->map, samples->size);
+    close(samples->fd);
+}
+
+// Identity of the file for the result cache. Hashing the contents of a huge file
+// would cost as much as integrating it, so a rewritten file is recognized by its
+// modification time instead
+static uint64_t samples_id(const struct samples *samples)
+{
+    struct stat st;
+    if (fstat(samples->fd, &st))
+        return 0;
+    uint64_t fields[] = {
+        st.st_dev, st.st_ino, st.st_size, st.st_mtim.tv_sec, st.st_mtim.tv_nsec
+    };
+    return hash64(fields, sizeof fields, 'S') ?: 1;
+}
+
+// Parameters of the grid the samples are on
+static void samples_params(const struct samples *samples, struct integ_params *args)
+{
+    args->start = samples->start;
+    args->end = samples->end;
+    args->nsteps = samples->count - 1;
+}
+
+// Sums of even and odd samples of the chunk. A block is added up in SUM_LANES
+// lanes like block_sum() does: SUM_LANES is even, so every lane only gets samples
+// of the same parity, and the two halves of the lanes are reduced separately
+static void samples_chunk(const struct samples_job *job, long long chunk, farg_t *sums)
+{
+    long long first = chunk * job->chunksize;
+    long long last = (first + job->chunksize < job->count) ? first + job->chunksize
+                                                           : job->count;
+    farg_t res[2] = { .0 }, err[2] = { .0 };
+    for (long long i = first; i < last; i += BATCH_SIZE) {
+        size_t n = (last - i < BATCH_SIZE) ? last - i : BATCH_SIZE;
+        const farg_t *ys = &job->ys[i];
+
+        farg_t lanes[SUM_LANES] = { 0 };
+        size_t k = 0;
+        for (; k + SUM_LANES <= n; k += SUM_LANES) {
+            for (size_t l = 0; l < SUM_LANES; l++)
+                lanes[l] += ys[k + l];
+        }
+        for (; k < n; k++)
+            lanes[k % 2] += ys[k];
+        for (size_t width = SUM_LANES / 2; width >= 2; width /= 2) {
+            for (size_t l = 0; l < width; l++)
+                lanes[l] += lanes[l + width];
+        }
+
+        // lanes[0] has samples of the same parity as i
+        kahan_add(&res[i % 2], &err[i % 2], lanes[0]);
+        kahan_add(&res[1 - i % 2], &err[1 - i % 2], lanes[1]);
+    }
+
+    sums[0] = res[0];
+    sums[1] = res[1];
+    samples_release(&job->ys[first], (last - first) * sizeof *job->ys);
+}
+
+static void samples_worker(void *ctx, long long id)
+{
+    struct samples_job *job = ctx;
+    for (long long chunk; deque_next(job->deques, job->ndeques, id, &chunk);)
+        samples_chunk(job, chunk, &job->sums[2 * chunk]);
+}
+
+// The rules applied to samples y[0..m], with h the step: left is h * (y[0] + ...
+// + y[m - 1]), trapezoid is that plus h * (y[m] - y[0]) / 2, and Simpson is
+// h / 3 * (2 * even + 4 * odd - y[0] - y[m]) for even m. For odd m Simpson covers
+// y[0..m - 3] and the 3/8 rule the last three steps
+static enum error integrate_samples(struct pool *pool, const struct integ_params *args,
+                                    const struct integrand *func, struct integ_result *res)
+{
+    enum error err = PE_OK;
+    const struct samples *samples = func->samples;
+    long long m = samples->count - 1;
+    const farg_t *y = samples->ys;
+
+    struct samples_job job = {
+        .ys = (farg_t *)samples->ys,
+        .rule = !strcmp(args->rule->name, "simpson") ? SAMPLES_SIMPSON
+              : !strcmp(args->rule->name, "trapezoid") ? SAMPLES_TRAPEZOID : SAMPLES_LEFT,
+        .step = (samples->end - samples->start) / m,
+        .ndeques = pool->nthreads
+    };
+    // a single step is too few for Simpson
+    if ((SAMPLES_SIMPSON == job.rule) && (1 == m))
+        job.rule = SAMPLES_TRAPEZOID;
+    long long simpsonend = (m % 2) ? m - 3 : m;
+    samples_chunks(&job, args->chunksteps,
+                   (SAMPLES_SIMPSON == job.rule) ? simpsonend + 1
+                   : (SAMPLES_TRAPEZOID == job.rule) ? m + 1 : m);
+
+    job.sums = calloc(2 * job.nchunks, sizeof *job.sums);
+    except(NULL == job.sums, PE_MALLOC, err, sums_exc);
+
+    job.deques = deques_create(job.ndeques, job.nchunks);
+    except(NULL == job.deques, PE_MALLOC, err, deques_exc);
+
+    log("%lld samples in %lld chunks", job.count, job.nchunks);
+
+    pool_run(pool, &samples_worker, &job);
+
+    farg_t even = .0, odd = .0, evenerr = .0, odderr = .0;
+    for (long long i = 0; i < job.nchunks; i++) {
+        kahan_add(&even, &evenerr, job.sums[2 * i]);
+        kahan_add(&odd, &odderr, job.sums[2 * i + 1]);
+    }
+
+    farg_t h = job.step;
+    long long nevals = job.count;
+    if (SAMPLES_LEFT == job.rule)
+        res->value = h * (even + odd);
+    else if (SAMPLES_TRAPEZOID == job.rule)
+        res->value = h * (even + odd - (y[0] + y[m]) / 2);
+    else {
+        res->value = h / 3 * (2 * even + 4 * odd - y[0] - y[simpsonend]);
+        if (m % 2) {
+            res->value += 3 * h / 8 * (y[m - 3] + 3 * y[m - 2] + 3 * y[m - 1] + y[m]);
+            nevals += 3;
+        }
+    }
+    res->nevals = nevals;
+
+    free(job.deques);
+deques_exc:
+    free(job.sums);
+sums_exc:
+    return err;
+}
+
+
+// Loaded plugins and compiled expressions. Each library is opened once and kept
+// open for the lifetime of the context, so a batch of jobs does not pay dlopen for
+// every integral
+struct plugin {
+    char *name;    // funcname as given by the user, the expression or the file
+    void *handle;  // NULL for an expression or a sample file
+    struct integrand func;
+    struct plugin *next;
+};
+
+struct registry {
+    pthread_mutex_t lock;    // integrands may be loaded from any thread
+    char *plugindir;
+    struct plugin *head;
+};
+
+static enum error plugin_load(const char *plugindir, const char *name, struct plugin *plugin)
+{
+    enum error err = PE_OK;
+
+    char *funcname;
+    asprintf(&funcname, "%s%s", FUNC_PREFIX, name);
+    except(NULL == funcname, PE_MALLOC, err, funcname_alloc);
+
+    char *ldname;
+    asprintf(&ldname, "%s/%s.so", plugindir, funcname);
+    except(NULL == ldname, PE_MALLOC, err, ldname_alloc);
+
+    log("Trying to load func '%s' from '%s'", funcname, ldname);
+
+    void *handle = dlopen(ldname, RTLD_NOW | RTLD_LOCAL);
+    if (NULL == handle)
+        snprintf(errdetail, sizeof errdetail, "%s", dlerror());
+    except(NULL == handle, PE_DLERR, err, dlopen_exc);
+
+    // funcname followed by suffix. Names longer than the buffer are not found
+    void *lookup(const char *suffix)
+    {
+        char symname[256];
+        snprintf(symname, sizeof symname, "%s%s", funcname, suffix);
+        return dlsym(handle, symname);
+    }
+
+    // Batched functions are optional, so look them up first. Otherwise dlerror()
+    // would report the missing optional symbol instead of the required one.
+    // Separate statements, as evaluation order of initializers is unspecified
+    // Libraries with multi-dimensional or multi-output functions only are fine as well
+    struct integrand dlfunc = { .nout = 1 };
+    dlfunc.funcf = lookup("f");
+    dlfunc.funcl = lookup("l");
+    dlfunc.batchf = lookup("f" BATCH_SUFFIX);
+    dlfunc.batchl = lookup("l" BATCH_SUFFIX);
+    dlfunc.ndbatch = lookup(ND_SUFFIX BATCH_SUFFIX);
+    dlfunc.ndfunc = lookup(ND_SUFFIX);
+    dlfunc.multi = lookup(MULTI_SUFFIX);
+    const unsigned *nout = lookup(NOUT_SUFFIX);
+    dlfunc.parambatch = lookup(PARAM_SUFFIX BATCH_SUFFIX);
+    dlfunc.paramfunc = lookup(PARAM_SUFFIX);
+    dlfunc.batch = lookup(BATCH_SUFFIX);
+    dlfunc.func = lookup("");
+    bool isfound = dlfunc.func || dlfunc.batch || dlfunc.ndfunc || dlfunc.ndbatch ||
+                   dlfunc.multi || dlfunc.paramfunc || dlfunc.parambatch;
+    if (!isfound)
+        snprintf(errdetail, sizeof errdetail, "%s", dlerror());
+    except(!isfound, PE_DLERR, err, dlsym_exc);
+
+    if (NULL != dlfunc.multi) {
+        bool isnout = (NULL != nout) && (*nout >= 1) && (*nout <= MAX_FUSED);
+        if (!isnout) {
+            snprintf(errdetail, sizeof errdetail, "%s" NOUT_SUFFIX " must be 1..%d",
+                     funcname, MAX_FUSED);
+        }
+        except(!isnout, PE_DLERR, err, dlsym_exc);
+        dlfunc.nout = *nout;
+    }
+
+    // the library file may be replaced later, but this is what has been loaded
+    dlfunc.id = hash_file(ldname);
+
+    log("Loaded '%s'%s", funcname, dlfunc.batch ? " with batched entry point" : "");
+
+    *plugin = (struct plugin){ .name = strdup(name), .handle = handle, .func = dlfunc };
+    except(NULL == plugin->name, PE_MALLOC, err, dlsym_exc);
+    plugin->func.name = plugin->name;
+    goto dlopen_exc;    // keep the library open
+
+dlsym_exc:
+    dlclose(handle);
+dlopen_exc:
+    free(ldname);
+ldname_alloc:
+    free(funcname);
+funcname_alloc:
+    return err;
+}
+
+// Find already loaded function or load it
+static enum error registry_get(struct registry *reg, const char *name,
+                               const struct integrand **funcptr)
+{
+    for (struct plugin *p = reg->head; NULL != p; p = p->next) {
+        if ((NULL != p->handle) && !strcmp(p->name, name)) {
+            *funcptr = &p->func;
+            return PE_OK;
+        }
+    }
+
+    struct plugin *plugin = malloc(sizeof *plugin);
+    if (NULL == plugin)
+        return PE_MALLOC;
+
+    enum error err = plugin_load(reg->plugindir, name, plugin);
+    if (PE_OK != err) {
+        free(plugin);
+        return err;
+    }
+
+    plugin->next = reg->head;
+    reg->head = plugin;
+    *funcptr = &plugin->func;
+    return PE_OK;
+}
+
+// Fixed step rules, as opposed to the methods picking their points themselves
+static bool is_fixed_method(const struct integ_params *args)
+{
+    return (SAMPLING_GRID == args->sampling) && !args->isromberg && (args->tolerance <= 0);
+}
+
+// Check that the function has entry points for the method and dimensions of args.
+// Functions with several outputs only fit into a pass of fixed steps
+static enum error integrand_check(const struct integrand *func, const struct integ_params *args)
+{
+    // samples only fit a few rules on their own grid, the parameter which does
+    // not goes to errdetail like params_check() does
+    if (NULL != func->samples) {
+        const char *rule = args->rule ? args->rule->name : "left";
+        const char *wrong = (SAMPLING_GRID != args->sampling) ? "sampling"
+                          : args->isromberg ? "isromberg"
+                          : (args->tolerance > 0) ? "tolerance"
+                          : (args->nparams > 0) ? "nparams"
+                          : (strcmp(rule, "left") && strcmp(rule, "trapezoid") &&
+                             strcmp(rule, "simpson")) ? "rule" : NULL;
+        if (NULL != wrong)
+            snprintf(errdetail, sizeof errdetail, "%s", wrong);
+        return (NULL != wrong) ? PE_WRONGARG : PE_OK;
+    }
+
+    bool has1d = func->func || func->batch || func->expr;
+    bool hasnd = func->ndfunc || func->ndbatch;
+    bool isfixed = is_fixed_method(args);
+    const char *prefix = func->expr ? "" : FUNC_PREFIX;
+
+    if ((func->nout > 1) && !isfixed) {
+        snprintf(errdetail, sizeof errdetail, "%s%s has %u outputs, which are only"
+                 " integrated by fixed step rules", prefix, func->name, func->nout);
+        return PE_DLERR;
+    }
+
+    // a parameter is passed by the fixed step double kernel only
+    if (args->nparams > 0) {
+        bool isok = (func->paramfunc || func->parambatch) && (1 == func->nout);
+        if (!isok) {
+            snprintf(errdetail, sizeof errdetail, "%s%s has no " PARAM_SUFFIX " entry point",
+                     prefix, func->name);
+        } else if (!isfixed || (PREC_DOUBLE != args->precision)) {
+            snprintf(errdetail, sizeof errdetail, "%s%s of a parameter is only integrated"
+                     " by fixed step rules in double precision", prefix, func->name);
+            isok = false;
+        }
+        return isok ? PE_OK : PE_DLERR;
+    }
+
+    bool isok = (args->ndim > 1) ? hasnd
+                                 : (has1d || (func->multi && isfixed) ||
+                                    (hasnd && (SAMPLING_GRID != args->sampling)));
+    if (!isok) {
+        snprintf(errdetail, sizeof errdetail, "%s%s has no %lld-dimensional entry point",
+                 prefix, func->name, args->ndim);
+    }
+    return isok ? PE_OK : PE_DLERR;
+}
+
+// Parameters the methods can not work with. The name of the first wrong one
+// goes to errdetail
+static enum error params_check(const struct integ_params *args)
+{
+    const char *wrong = NULL;
+    if (args->nsteps <= 0)
+        wrong = "nsteps";
+    else if (args->chunksteps < 0)
+        wrong = "chunksteps";
+    else if ((args->ndim < 1) || (args->ndim > MC_MAX_DIM) ||
+             ((args->ndim > 1) && (SAMPLING_GRID == args->sampling)))
+        wrong = "ndim";
+    else if (!(args->end > args->start))
+        wrong = "end";
+    else if ((args->sampling < SAMPLING_GRID) || (args->sampling >= __SAMPLING_LAST))
+        wrong = "sampling";
+    else if ((args->precision < PREC_DOUBLE) || (args->precision >= __PREC_LAST))
+        wrong = "precision";
+    else if ((args->tolerance > 0) && (args->maxsegments < 1))
+        wrong = "maxsegments";
+    else if (args->nparams < 0)
+        wrong = "nparams";
+
+    for (long long d = 0; (NULL == wrong) && (NULL != args->box) && (d < args->ndim); d++) {
+        if (!(args->box[2 * d + 1] > args->box[2 * d]))
+            wrong = "box";
+    }
+
+    if (NULL != wrong)
+        snprintf(errdetail, sizeof errdetail, "%s", wrong);
+    return (NULL != wrong) ? PE_WRONGARG : PE_OK;
+}
+
+static void registry_free(struct registry *reg)
+{
+    while (NULL != reg->head) {
+        struct plugin *p = reg->head;
+        reg->head = p->next;
+        if (NULL != p->handle)
+            dlclose(p->handle);
+        expr_free((struct expr *)p->func.expr);
+        if (NULL != p->func.samples) {
+            samples_close((struct samples *)p->func.samples);
+            free((struct samples *)p->func.samples);
+        }
+        free(p->name);
+        free(p);
+    }
+}
+
+
+// Run a single integration with the method selected by args
+static enum error integrate(struct pool *pool, const struct integ_params *args,
+                            const struct integrand *func, struct integ_result *res)
+{
+    if (NULL != func->samples)
+        return integrate_samples(pool, args, func, res);
+    if (SAMPLING_GRID != args->sampling)
+        return integrate_sampling(pool, args, func, res);
+    if (args->isromberg)
+        return integrate_romberg(pool, args, func, res);
+    if (args->tolerance > 0)
+        return integrate_adaptive(pool, args, func, res);
+    return integrate_fixed(pool, args, func, res);
+}
+
+
+// Jobs and the dispatcher.
+// Submitted jobs are queued, and a single dispatcher thread takes up to BATCH_WINDOW
+// of them at a time. Small jobs of a window are spread over the pool one job per
+// worker at a time, because splitting a job which takes microseconds into chunks
+// costs more than computing it. Large ones are computed afterwards one by one with
+// all workers. So whoever submits jobs, and from however many threads, the work
+// is multiplexed onto the pool threads, and many concurrent tiny jobs are computed
+// together instead of one by one.
+#define BATCH_WINDOW 4096
+// fixed step jobs with less evaluations than this are small
+#define BATCH_SMALL_JOB (64 * MIN_AUTO_CHUNK)
+
+struct integ_job {
+    struct integ_ctx *ctx;
+    struct integ_params args;    // copy of the submitted ones, with the rule filled in
+    const struct integrand *funcs[MAX_FUSED];
+    int nfuncs;
+    int nout;                    // outputs of all funcs
+    long long nres;              // results: nout, or parameter values of a sweep
+    bool isfused;                // computed by integrate_fused(), not cached
+    bool issweep;                // computed by integrate_sweep(), not cached
+    const char *tabpath;         // tabulated into this file instead, not cached
+    bool issmall;
+    bool iskeyed;                // key is valid, the result may be cached
+    bool iscached;               // result is taken from the cache
+    uint64_t key[2];
+    enum error err;
+    struct integ_result *res;    // resbuf unless there are more results
+    struct integ_result resbuf[MAX_FUSED];
+    bool isdone;                 // set by the dispatcher under ctx->lock
+    struct integ_job *next;      // in the queue
+};
+
+struct integ_ctx {
+    struct pool *pool;
+    struct registry registry;
+    struct cache cache;
+    struct cache *cacheptr;      // NULL if there is no cache
+    pthread_t dispatcher;
+    pthread_mutex_t lock;
+    pthread_cond_t queued;       // a job is added to the queue, or we are stopping
+    pthread_cond_t done;         // some jobs are computed
+    struct integ_job *head;
+    struct integ_job **tailptr;
+    bool isstopping;
+    struct integ_job *window[BATCH_WINDOW];    // used by the dispatcher only
+};
+
+struct batch_window {
+    struct integ_job **jobs;
+    long long njobs;
+    long long next;      // next job to take, shared by workers
+};
+
+static void batch_worker(void *ctx, long long id)
+{
+    struct batch_window *win = ctx;
+    long long i, ndone = 0;
+    while ((i = __atomic_fetch_add(&win->next, 1, __ATOMIC_RELAXED)) < win->njobs) {
+        struct integ_job *job = win->jobs[i];
+        if (job->issmall && !job->iscached) {
+            job->res[0] = integrate_fixed_serial(&job->args, job->funcs[0]);
+            ndone++;
+        }
+    }
+    log("Worker #%lld did %lld small jobs", id, ndone);
+}
+
+// Compute all jobs of the window. The cache is only used by the dispatcher: all
+// lookups are done before the workers start and all stores after they finish
+static void batch_run_window(struct pool *pool, struct cache *cache, struct batch_window *win)
+{
+    long long nsmall = 0;
+    for (long long i = 0; i < win->njobs; i++) {
+        struct integ_job *job = win->jobs[i];
+        job->iskeyed = (NULL != cache) && !job->isfused && !job->issweep &&
+                       (NULL == job->tabpath) && cache_key(&job->args, job->funcs[0], job->key);
+        job->iscached = job->iskeyed && cache_lookup(cache, job->key, &job->res[0]);
+        nsmall += job->issmall && !job->iscached;
+    }
+
+    // waking up the workers for a single small job costs more than the job,
+    // so it is done by the dispatcher itself
+    win->next = 0;
+    if (nsmall > 1)
+        pool_run(pool, &batch_worker, win);
+    else if (1 == nsmall)
+        batch_worker(win, -1);
+
+    for (long long i = 0; i < win->njobs; i++) {
+        struct integ_job *job = win->jobs[i];
+        if (job->issmall || job->iscached)
+            continue;
+        job->err = job->tabpath
+                   ? tabulate(pool, &job->args, job->funcs[0], job->tabpath, job->res)
+                   : job->issweep
+                   ? integrate_sweep(pool, &job->args, job->funcs[0], job->res)
+                   : job->isfused
+                   ? integrate_fused(pool, &job->args, job->funcs, job->nfuncs, job->res)
+                   : integrate(pool, &job->args, job->funcs[0], job->res);
+    }
+
+    for (long long i = 0; i < win->njobs; i++) {
+        struct integ_job *job = win->jobs[i];
+        if (job->iskeyed && !job->iscached && (PE_OK == job->err))
+            cache_store(cache, job->key, &job->res[0]);
+    }
+}
+
+static void *dispatcher(void *argsptr)
+{
+    struct integ_ctx *ctx = argsptr;
+    struct batch_window win = { .jobs = ctx->window };
+
+    pthread_mutex_lock(&ctx->lock);
+    for (;;) {
+        while ((NULL == ctx->head) && !ctx->isstopping)
+            pthread_cond_wait(&ctx->queued, &ctx->lock);
+        if (NULL == ctx->head)
+            break;    // stopping, and everything queued is done
+
+        for (win.njobs = 0; (NULL != ctx->head) && (win.njobs < BATCH_WINDOW);
+             ctx->head = ctx->head->next)
+            win.jobs[win.njobs++] = ctx->head;
+        if (NULL == ctx->head)
+            ctx->tailptr = &ctx->head;
+        pthread_mutex_unlock(&ctx->lock);
+
+        batch_run_window(ctx->pool, ctx->cacheptr, &win);
+
+        // the owners may free the jobs right after this
+        pthread_mutex_lock(&ctx->lock);
+        for (long long i = 0; i < win.njobs; i++)
+            __atomic_store_n(&win.jobs[i]->isdone, true, __ATOMIC_RELEASE);
+        pthread_cond_broadcast(&ctx->done);
+
+        log("Dispatched %lld jobs", win.njobs);
+    }
+    pthread_mutex_unlock(&ctx->lock);
+    return NULL;
+}
+
+
+// Public interface, see libintegrate.h
+
+enum error integ_create(const struct integ_config *config, struct integ_ctx **ctxptr)
+{
+    enum error err = PE_OK;
+    errdetail[0] = '\0';
+
+    if (config->nthreads < 1) {
+        snprintf(errdetail, sizeof errdetail, "nthreads");
+        return PE_WRONGARG;
+    }
+
+    struct integ_ctx *ctx = calloc(1, sizeof *ctx);
+    except(NULL == ctx, PE_MALLOC, err, ctx_exc);
+
+    ctx->registry.plugindir = strdup(config->plugindir ?: ".");
+    except(NULL == ctx->registry.plugindir, PE_MALLOC, err, dir_exc);
+
+    if (NULL != config->cachefile) {
+        err = cache_open(config->cachefile, config->cacheslots, &ctx->cache);
+        except(PE_OK != err, err, err, cache_exc);
+        ctx->cacheptr = &ctx->cache;
+    }
+
+    err = pool_create(config->nthreads, config->cpus, config->ncpus, config->isstats,
+                      &ctx->pool);
+    except(PE_OK != err, err, err, pool_exc);
+
+    pthread_mutex_init(&ctx->registry.lock, NULL);
+    pthread_mutex_init(&ctx->lock, NULL);
+    pthread_cond_init(&ctx->queued, NULL);
+    pthread_cond_init(&ctx->done, NULL);
+    ctx->tailptr = &ctx->head;
+    except(pthread_create(&ctx->dispatcher, NULL, &dispatcher, ctx), PE_THREAD, err,
+           thread_exc);
+
+    *ctxptr = ctx;
+    return PE_OK;
+
+thread_exc:
+    pool_destroy(ctx->pool);
+pool_exc:
+    if (NULL != ctx->cacheptr)
+        cache_close(ctx->cacheptr);
+cache_exc:
+    free(ctx->registry.plugindir);
+dir_exc:
+    free(ctx);
+ctx_exc:
+    return err;
+}
+
+void integ_destroy(struct integ_ctx *ctx)
+{
+    pthread_mutex_lock(&ctx->lock);
+    ctx->isstopping = true;
+    pthread_cond_signal(&ctx->queued);
+    pthread_mutex_unlock(&ctx->lock);
+    pthread_join(ctx->dispatcher, NULL);
+
+    pool_destroy(ctx->pool);
+    if (NULL != ctx->cacheptr)
+        cache_close(ctx->cacheptr);
+    registry_free(&ctx->registry);
+    free(ctx->registry.plugindir);
+    free(ctx);
+}
+
+enum error integ_load(struct integ_ctx *ctx, const char *name,
+                      const struct integrand **funcptr)
+{
+    errdetail[0] = '\0';
+    pthread_mutex_lock(&ctx->registry.lock);
+    enum error err = registry_get(&ctx->registry, name, funcptr);
+    pthread_mutex_unlock(&ctx->registry.lock);
+    return err;
+}
+
+enum error integ_expr(struct integ_ctx *ctx, const char *src,
+                      const struct integrand **funcptr, size_t *errpos, const char **errmsg)
+{
+    enum error err = PE_OK;
+    errdetail[0] = '\0';
+
+    struct plugin *plugin = calloc(1, sizeof *plugin);
+    except(NULL == plugin, PE_MALLOC, err, plugin_exc);
+
+    plugin->name = strdup(src);
+    except(NULL == plugin->name, PE_MALLOC, err, name_exc);
+
+    struct expr *expr = expr_compile(src, errpos, errmsg);
+    if (NULL == expr)
+        snprintf(errdetail, sizeof errdetail, "%s", src);
+    except(NULL == expr, PE_WRONGARG, err, expr_exc);
+
+    log("Compiled '%s' into %d instructions", src, expr_length(expr));
+    plugin->func = (struct integrand){
+        .name = plugin->name,
+        .expr = expr,
+        .nout = 1,
+        .id = hash64(src, strlen(src), 'E') ?: 1
+    };
+
+    // not found by integ_load(), as there is no handle
+    pthread_mutex_lock(&ctx->registry.lock);
+    plugin->next = ctx->registry.head;
+    ctx->registry.head = plugin;
+    pthread_mutex_unlock(&ctx->registry.lock);
+
+    *funcptr = &plugin->func;
+    return PE_OK;
+
+expr_exc:
+    free(plugin->name);
+name_exc:
+    free(plugin);
+plugin_exc:
+    return err;
+}
+
+enum error integ_samples(struct integ_ctx *ctx, const char *path,
+                         const struct integrand **funcptr)
+{
+    enum error err = PE_OK;
+    errdetail[0] = '\0';
+
+    struct plugin *plugin = calloc(1, sizeof *plugin);
+    except(NULL == plugin, PE_MALLOC, err, plugin_exc);
+
+    plugin->name = strdup(path);
+    except(NULL == plugin->name, PE_MALLOC, err, name_exc);
+
+    struct samples *samples = malloc(sizeof *samples);
+    except(NULL == samples, PE_MALLOC, err, samples_exc);
+
+    err = samples_open(path, samples);
+    except(PE_OK != err, err, err, open_exc);
+
+    log("Mapped %lld samples of [%g; %g] from '%s'", samples->count, samples->start,
+        samples->end, path);
+    plugin->func = (struct integrand){
+        .name = plugin->name,
+        .samples = samples,
+        .nout = 1,
+        .id = samples_id(samples)
+    };
+
+    // not found by integ_load() either
+    pthread_mutex_lock(&ctx->registry.lock);
+    plugin->next = ctx->registry.head;
+    ctx->registry.head = plugin;
+    pthread_mutex_unlock(&ctx->registry.lock);
+
+    *funcptr = &plugin->func;
+    return PE_OK;
+
+open_exc:
+    free(samples);
+samples_exc:
+    free(plugin->name);
+name_exc:
+    free(plugin);
+plugin_exc:
+    return err;
+}
+
+unsigned integ_nout(const struct integrand *func)
+{
+    return func->nout;
+}
+
+// Check the parameters and make a job of them. It is queued by job_queue()
+static enum error job_create(struct integ_ctx *ctx, const struct integrand *const *funcs,
+                             int nfuncs, const struct integ_params *params,
+                             struct integ_job **jobptr)
+{
+    errdetail[0] = '\0';
+    int nout = 0, nsamples = 0;
+    for (int f = 0; (f < nfuncs) && (f < MAX_FUSED); f++) {
+        nout += funcs[f]->nout;
+        nsamples += (NULL != funcs[f]->samples);
+    }
+
+    bool isfused = (nfuncs > 1) || (nout > 1);
+    bool issweep = (params->nparams > 1);
+    if ((nfuncs < 1) || (nfuncs > MAX_FUSED) || (nout > MAX_FUSED) ||
+        (isfused && (!is_fixed_method(params) || nsamples || issweep))) {
+        // comma separated names, as the list is given to dlintegrate -F
+        size_t len = 0;
+        for (int f = 0; (f < nfuncs) && (len < sizeof errdetail); f++) {
+            len += snprintf(errdetail + len, sizeof errdetail - len, "%s%s", f ? "," : "",
+                            funcs[f]->name);
+        }
+        return PE_WRONGARG;
+    }
+
+    // a sample file brings its own grid
+    struct integ_params args = *params;
+    if (nsamples)
+        samples_params(funcs[0]->samples, &args);
+
+    enum error err = params_check(&args);
+    for (int f = 0; (f < nfuncs) && (PE_OK == err); f++)
+        err = integrand_check(funcs[f], &args);
+    if (PE_OK != err)
+        return err;
+
+    struct integ_job *job = malloc(sizeof *job);
+    if (NULL == job)
+        return PE_MALLOC;
+
+    *job = (struct integ_job){
+        .ctx = ctx,
+        .args = args,
+        .nfuncs = nfuncs,
+        .nout = nout,
+        .nres = issweep ? args.nparams : nout,
+        .isfused = isfused,
+        .issweep = issweep,
+        .err = PE_OK
+    };
+    job->res = job->resbuf;
+    if (job->nres > MAX_FUSED) {
+        job->res = calloc(job->nres, sizeof *job->res);
+        if (NULL == job->res) {
+            free(job);
+            return PE_MALLOC;
+        }
+    }
+    memcpy(job->funcs, funcs, nfuncs * sizeof *funcs);
+    job->args.rule = params->rule ?: &RULES[0];
+    job->issmall = !isfused && !issweep && !nsamples && is_fixed_method(&job->args) &&
+                   (job->args.nsteps * job->args.rule->npoints < BATCH_SMALL_JOB);
+    *jobptr = job;
+    return PE_OK;
+}
+
+static void job_queue(struct integ_ctx *ctx, struct integ_job *job)
+{
+    // the dispatcher only sleeps when the queue is empty
+    pthread_mutex_lock(&ctx->lock);
+    if (NULL == ctx->head)
+        pthread_cond_signal(&ctx->queued);
+    *ctx->tailptr = job;
+    ctx->tailptr = &job->next;
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+enum error integ_submit(struct integ_ctx *ctx, const struct integrand *const *funcs,
+                        int nfuncs, const struct integ_params *params,
+                        struct integ_job **jobptr)
+{
+    enum error err = job_create(ctx, funcs, nfuncs, params, jobptr);
+    if (PE_OK == err)
+        job_queue(ctx, *jobptr);
+    return err;
+}
+
+enum error integ_tabulate(struct integ_ctx *ctx, const struct integrand *func,
+                          const struct integ_params *params, const char *path,
+                          struct integ_job **jobptr)
+{
+    // a sample file can not be evaluated at other points, and a single output
+    // goes to a file
+    if ((NULL != func->samples) || (func->nout > 1)) {
+        snprintf(errdetail, sizeof errdetail, "%s", func->name);
+        return PE_WRONGARG;
+    }
+
+    // only the grid matters
+    struct integ_params args = INTEG_PARAMS_DEFAULT;
+    args.start = params->start;
+    args.end = params->end;
+    args.nsteps = params->nsteps;
+    args.chunksteps = params->chunksteps;
+
+    enum error err = job_create(ctx, &func, 1, &args, jobptr);
+    if (PE_OK != err)
+        return err;
+    (*jobptr)->tabpath = path;
+    (*jobptr)->issmall = false;
+    job_queue(ctx, *jobptr);
+    return PE_OK;
+}
+
+bool integ_poll(const struct integ_job *job)
+{
+    return __atomic_load_n(&job->isdone, __ATOMIC_ACQUIRE);
+}
+
+enum error integ_wait(struct integ_job *job, struct integ_result *res)
+{
+    // most jobs of a batch are long done by the time they are waited for
+    struct integ_ctx *ctx = job->ctx;
+    if (!integ_poll(job)) {
+        pthread_mutex_lock(&ctx->lock);
+        while (!job->isdone)
+            pthread_cond_wait(&ctx->done, &ctx->lock);
+        pthread_mutex_unlock(&ctx->lock);
+    }
+
+    // partial results are useful too, e.g. when the adaptive method does not converge
+    enum error err = job->err;
+    memcpy(res, job->res, job->nres * sizeof *res);
+    errdetail[0] = '\0';
+    // the only error of the computation with a detail, which is the file
+    if (PE_SAMPLES == err)
+        snprintf(errdetail, sizeof errdetail, "%s", job->tabpath);
+    if (job->resbuf != job->res)
+        free(job->res);
+    free(job);
+    return err;
+}
+
+enum error integ_run(struct integ_ctx *ctx, const struct integrand *const *funcs,
+                     int nfuncs, const struct integ_params *params, struct integ_result *res)
+{
+    struct integ_job *job;
+    enum error err = integ_submit(ctx, funcs, nfuncs, params, &job);
+    return (PE_OK == err) ? integ_wait(job, res) : err;
+}
+
+void integ_report_stats(struct integ_ctx *ctx, FILE *out)
+{
+    if (NULL == ctx->pool->stats)
+        fprintf(out, "Stats are not collected\n");
+    else
+        pool_report_stats(ctx->pool, out);
+}
+
+void integ_cache_stats(struct integ_ctx *ctx, long long *nhits, long long *nmisses)
+{
+    // updated by the dispatcher, so exact when nothing is queued
+    *nhits = ctx->cacheptr ? __atomic_load_n(&ctx->cache.nhits, __ATOMIC_RELAXED) : 0;
+    *nmisses = ctx->cacheptr ? __atomic_load_n(&ctx->cache.nmisses, __ATOMIC_RELAXED) : 0;
+}
@@ -0,0 +1,227 @@
+/**
+ * libintegrate -- everything dlintegrate does, as a library to be embedded.
+ *
+ * A context owns a pool of worker threads, the loaded plugins (see FUNC_PREFIX)
+ * and optionally a result cache file. Integrals are submitted to it and computed
+ * in the background by a single dispatcher thread on the pool, so a call returns
+ * a job handle right away, which may be polled or waited for. Many small jobs
+ * submitted together are spread over the workers one job per worker, large ones
+ * get all the workers, same as dlintegrate -b does.
+ *
+ * Nothing here exits or prints: every call returns enum error, and
+ * integ_errdetail() tells what exactly has failed, like dlerror() does.
+ * All calls may be made from any thread.
+ *
+ * Static and shared builds, with dlexpr.c compiled the same way:
+ *   gcc -O2 -std=gnu18 -fPIC -c libintegrate.c -o libintegrate.o
+ *   ar rcs libintegrate.a libintegrate.o dlexpr.o
+ *   gcc -shared libintegrate.o dlexpr.o -lm -pthread -ldl -o libintegrate.so
+ */
+
+#ifndef LIBINTEGRATE_H
+#define LIBINTEGRATE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+// Plugins are FUNC_PREFIX funcname in FUNC_PREFIX funcname.so. Entry points other
+// than the scalar double (*)(double) are optional and found by these suffixes:
+// batched ys[i] = f(xs[i]), and float and long double variants of both with
+// 'f' and 'l' appended to funcname, like sinf() and sinl() of libm
+#define FUNC_PREFIX "dlfunc_"
+#define BATCH_SUFFIX "_batch"
+// multi-dimensional f(x, dim) and f(xs, ys, n, dim) for the sampling methods
+#define ND_SUFFIX "_nd"
+// several outputs at once f(xs, ys, n) and their number, a const unsigned
+#define MULTI_SUFFIX "_multi"
+#define NOUT_SUFFIX "_nout"
+// f(x, p) of a parameter, and batched f(xs, ys, n, p), see integ_params.nparams
+#define PARAM_SUFFIX "_param"
+
+// Integrands (or outputs of them) computed in a single pass, see integ_submit()
+#define MAX_FUSED 16
+// Sobol direction numbers are known for this many dimensions
+#define MC_MAX_DIM 21
+// Points are sampled in blocks of this size, and Sobol error estimate takes this
+// many independently shifted copies of the sequence
+#define MC_BLOCK 4096
+#define SOBOL_REPLICAS 16
+// Fixed step grids are cut into at most this many chunks unless asked otherwise
+#define MAX_AUTO_CHUNKS 65536
+// Result cache file size
+#define CACHE_DEFAULT_SLOTS 65536
+#define CACHE_SLOT_SIZE 64
+
+
+enum error {
+    PE_OK = 0,          /* No error                                        */
+    PE_NOARGS,          /* No arguments provided                           */
+    PE_WRONGARG,        /* Argument has wrong format                       */
+    PE_NENARGS,         /* Not enough arguments                            */
+    PE_TMARGS,          /* Too much arguments                              */
+    PE_CVGERR,          /* Convergence error                               */
+    PE_MALLOC,          /* Memory allocation error                         */
+    PE_THREAD,          /* Threading error                                 */
+    PE_DLERR,           /* Dynamic loader error                            */
+    PE_SOCKET,          /* Socket error                                    */
+    PE_CACHE,           /* Result cache file error                         */
+    PE_SAMPLES,         /* Sample file error                               */
+    PE_JOBS,            /* Some of batch jobs have failed                  */
+    __PE_LAST           /* Last item. So that array sizes match everywhere */
+};
+
+// Message of the error, with a %s for integ_errdetail() where it has one
+const char *integ_strerror(enum error err);
+// What the last failed call of the calling thread has failed on: dlerror() text,
+// file name, the expression... Empty if there is nothing to add to integ_strerror()
+const char *integ_errdetail(void);
+
+
+// Instead of a grid of rule nodes, points may be sampled
+enum sampling {
+    SAMPLING_GRID = 0,    // fixed step rules, adaptive or Romberg method
+    SAMPLING_MC,          // pseudo-random points
+    SAMPLING_SOBOL,       // randomized quasi-random points
+    __SAMPLING_LAST
+};
+
+// Precision of the fixed step methods hot loop. Results are double anyway: long
+// double only keeps the rounding errors of points and sums out of them
+enum precision {
+    PREC_DOUBLE = 0,
+    PREC_FLOAT,
+    PREC_LDOUBLE,
+    __PREC_LAST
+};
+
+// Quadrature rule of the fixed step methods: left, midpoint, trapezoid, simpson,
+// gauss2..gauss5. NULL if there is no such rule
+struct rule;
+const struct rule *integ_rule(const char *name);
+
+
+// What to integrate and how. Start from INTEG_PARAMS_DEFAULT
+struct integ_params {
+    double start;
+    double end;
+    long long nsteps;        // or points of the sampling methods, or Romberg limit
+    long long chunksteps;    // 0 picks the chunk size automatically
+    double tolerance;        // > 0 selects the adaptive method (unless isromberg)
+    long long maxsegments;   // memory limit of the adaptive method
+    double budget;           // seconds for Romberg, 0 for no limit
+    const struct rule *rule; // NULL for the left rectangles
+    enum sampling sampling;
+    long long ndim;          // dimensions of the sampling methods
+    const double *box;       // ndim (start, end) pairs, [start; end] on every axis if NULL
+    unsigned long long seed; // of the sampling methods
+    enum precision precision;
+    bool isromberg;
+    FILE *trace;             // Romberg levels are reported here if not NULL
+    // With nparams > 0 the integrand takes a parameter, and the integral is computed
+    // for nparams values of it evenly spaced over [param; paramend] (param alone if
+    // nparams is 1) giving as many results. Only fixed step rules in double
+    // precision do that. All values are computed at once: chunks of every integral
+    // are spread over the workers together, so a sweep of small integrals keeps all
+    // of them busy too
+    double param;
+    double paramend;
+    long long nparams;
+};
+
+#define INTEG_PARAMS_DEFAULT { .nsteps = 10e6, .maxsegments = 1 << 20, .ndim = 1 }
+
+
+struct integ_config {
+    long long nthreads;
+    const int *cpus;         // worker i is pinned to cpus[i % ncpus] unless NULL
+    int ncpus;
+    const char *plugindir;   // where plugin libraries are looked up
+    const char *cachefile;   // results are cached in this file if not NULL
+    long long cacheslots;    // 0 keeps the size of an existing cache
+    bool isstats;            // collect per worker stats, see integ_report_stats()
+};
+
+struct integ_ctx;
+
+enum error integ_create(const struct integ_config *config, struct integ_ctx **ctxptr);
+// All submitted jobs have to be waited for before
+void integ_destroy(struct integ_ctx *ctx);
+
+
+// Integrands are owned by the context and valid until it is destroyed.
+// integ_load() opens a plugin library once, later calls return the same integrand
+struct integrand;
+enum error integ_load(struct integ_ctx *ctx, const char *name,
+                      const struct integrand **funcptr);
+// Expression of x, see dlexpr.h. On a syntax error errpos and errmsg (if not NULL)
+// tell where and what is wrong, same as expr_compile() does
+enum error integ_expr(struct integ_ctx *ctx, const char *src,
+                      const struct integrand **funcptr, size_t *errpos, const char **errmsg);
+// Number of results the integrand gives, more than 1 for fused multi-output plugins
+unsigned integ_nout(const struct integrand *func);
+
+// Sample files hold values of a function at count equally spaced points of
+// [start; end], both ends included: measured data, or a tabulated function which
+// is too expensive to evaluate again. They are mapped into memory and streamed
+// through by all workers without copying, and pages are released as soon as they
+// are processed, so files much larger than RAM work with bounded resident memory.
+// Layout (native byte order): struct samples_header padded to
+// SAMPLES_DATA_OFFSET, then count doubles
+#define SAMPLES_MAGIC "DLISMPLS"
+#define SAMPLES_VERSION 1
+#define SAMPLES_DATA_OFFSET 4096
+
+struct samples_header {
+    char magic[8];
+    unsigned int version;
+    unsigned int samplesize;    // sizeof(double)
+    unsigned long long count;
+    double start;
+    double end;
+};
+
+// Open the file as an integrand. Its interval and steps come from the file, so
+// start, end and nsteps given to integ_submit() are ignored. Only the left,
+// trapezoid (the right one for samples) and simpson rules fit the samples. An odd
+// number of steps gets the Simpson 3/8 rule on the last three of them
+enum error integ_samples(struct integ_ctx *ctx, const char *path,
+                         const struct integrand **funcptr);
+
+
+struct integ_result {
+    double value;
+    double errest;      // adaptive method estimate, or standard error of sampling
+    long long nevals;   // number of function evaluations
+};
+
+// Integrate funcs over the same grid in a single pass if nfuncs > 1. That only
+// works with fixed step rules, and such runs are not cached. The parameters are
+// copied, the box is not. Errors of the integrands and parameters are reported
+// here, those of the computation by integ_wait()
+struct integ_job;
+enum error integ_submit(struct integ_ctx *ctx, const struct integrand *const *funcs,
+                        int nfuncs, const struct integ_params *params,
+                        struct integ_job **jobptr);
+// True when the job is done and integ_wait() would not block
+bool integ_poll(const struct integ_job *job);
+// Wait for the job, store a result per output of every integrand (per parameter
+// value for a sweep) and free the job
+enum error integ_wait(struct integ_job *job, struct integ_result *res);
+// Submit writing nsteps + 1 samples of func over [start; end] (chunksteps of them
+// per chunk) to a sample file, which is created or overwritten. Other parameters
+// are not used. The path is not copied. The result only has nevals
+enum error integ_tabulate(struct integ_ctx *ctx, const struct integrand *func,
+                          const struct integ_params *params, const char *path,
+                          struct integ_job **jobptr);
+// Submit and wait
+enum error integ_run(struct integ_ctx *ctx, const struct integrand *const *funcs,
+                     int nfuncs, const struct integ_params *params, struct integ_result *res);
+
+
+// Evaluations, wall and CPU time and hardware counters of every worker
+void integ_report_stats(struct integ_ctx *ctx, FILE *out);
+// Cache lookups so far, both are 0 without the cache
+void integ_cache_stats(struct integ_ctx *ctx, long long *nhits, long long *nmisses);
+
+#endif /* LIBINTEGRATE_H */
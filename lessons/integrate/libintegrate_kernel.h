@@ -0,0 +1,179 @@
+/**
+ * Precision dependent part of libintegrate.c -- the hot loop of fixed step methods.
+ *
+ * This is a poor man's template: the file has no include guard and is included
+ * by libintegrate.c once per floating point type with three macros defined:
+ *      KERNEL_T    -- the type itself
+ *      KERNEL_SFX  -- suffix appended to everything defined here, and also used
+ *                     to find struct integrand members of this precision.
+ *                     Empty for double, so integrand_eval() is the double one
+ *                     while integrand_evalf() is for float and integrand_evall()
+ *                     for long double. Same as in libm
+ *      KERNEL_WIDE -- type of grid points before the offsets inside a block are
+ *                     added, the wider of farg_t and KERNEL_T
+ * Define KERNEL_NATIVE for the type the plugins are required to provide (double).
+ * Other types fall back to a scalar entry point of their own, and then to
+ * converting points to double if the plugin lacks them.
+ */
+
+#define KCAT_(a, b) a##b
+#define KCAT(a, b) KCAT_(a, b)
+#define KFN(name) KCAT(name, KERNEL_SFX)
+
+// Evaluate function at n points with the plugin entry point of this precision
+static inline void KFN(integrand_eval)(const struct integrand *f,
+                                       const KERNEL_T *restrict xs, KERNEL_T *restrict ys,
+                                       size_t n)
+{
+#ifdef KERNEL_NATIVE
+    // only double has parameters, see integrand_check()
+    if (thread_param) {
+        thread_nevals += n;
+        if (f->parambatch)
+            f->parambatch(xs, ys, n, *thread_param);
+        else {
+            for (size_t i = 0; i < n; i++)
+                ys[i] = f->paramfunc(xs[i], *thread_param);
+        }
+        return;
+    }
+#endif
+    if (f->expr) {
+        thread_nevals += n;
+        KFN(expr_eval)(f->expr, xs, ys, n);
+        return;
+    }
+    if (f->KFN(batch)) {
+        thread_nevals += n;
+        f->KFN(batch)(xs, ys, n);
+        return;
+    }
+#ifdef KERNEL_NATIVE
+    thread_nevals += n;
+    for (size_t i = 0; i < n; i++)
+        ys[i] = f->func(xs[i]);
+#else
+    if (f->KFN(func)) {
+        thread_nevals += n;
+        for (size_t i = 0; i < n; i++)
+            ys[i] = f->KFN(func)(xs[i]);
+        return;
+    }
+
+    // plugin does not have this precision, go through the native one
+    farg_t wxs[BATCH_SIZE], wys[BATCH_SIZE];
+    for (size_t i = 0; i < n; i += BATCH_SIZE) {
+        size_t m = (n - i < BATCH_SIZE) ? n - i : BATCH_SIZE;
+        for (size_t k = 0; k < m; k++)
+            wxs[k] = xs[i + k];
+        integrand_eval(f, wxs, wys, m);
+        for (size_t k = 0; k < m; k++)
+            ys[i + k] = wys[k];
+    }
+#endif
+}
+
+// Same for integrands with several outputs: output o goes to ys[o * n .. (o + 1) * n)
+static inline void KFN(integrand_eval_multi)(const struct integrand *f,
+                                             const KERNEL_T *restrict xs,
+                                             KERNEL_T *restrict ys, size_t n)
+{
+    if (NULL == f->multi) {
+        KFN(integrand_eval)(f, xs, ys, n);
+        return;
+    }
+#ifdef KERNEL_NATIVE
+    thread_nevals += n * f->nout;
+    f->multi(xs, ys, n);
+#else
+    farg_t wxs[BATCH_SIZE], wys[MAX_FUSED * BATCH_SIZE];
+    for (size_t i = 0; i < n; i += BATCH_SIZE) {
+        size_t m = (n - i < BATCH_SIZE) ? n - i : BATCH_SIZE;
+        for (size_t k = 0; k < m; k++)
+            wxs[k] = xs[i + k];
+        integrand_eval_multi(f, wxs, wys, m);
+        for (unsigned o = 0; o < f->nout; o++) {
+            for (size_t k = 0; k < m; k++)
+                ys[o * n + i + k] = wys[o * m + k];
+        }
+    }
+#endif
+}
+
+
+// Sum of a block. SUM_LANES independent partial sums: compiler is not allowed to
+// reorder a plain sum loop, but lanes map onto SIMD registers directly. Each lane
+// adds up only n / SUM_LANES values, so the rounding error does not grow with nsteps
+static inline KERNEL_T KFN(block_sum)(const KERNEL_T *ys, size_t n)
+{
+    KERNEL_T lanes[SUM_LANES] = { 0 };
+    size_t i = 0;
+    for (; i + SUM_LANES <= n; i += SUM_LANES) {
+        for (size_t l = 0; l < SUM_LANES; l++)
+            lanes[l] += ys[i + l];
+    }
+    for (; i < n; i++)
+        lanes[0] += ys[i];
+
+    // pairwise
+    for (size_t width = SUM_LANES / 2; width; width /= 2) {
+        for (size_t l = 0; l < width; l++)
+            lanes[l] += lanes[l + width];
+    }
+    return lanes[0];
+}
+
+
+// Kahan compensated summation: err keeps the low order bits lost by sum
+static inline void KFN(kahan_add)(KERNEL_T *sum, KERNEL_T *err, KERNEL_T x)
+{
+    KERNEL_T y = x - *err;
+    KERNEL_T t = *sum + y;
+    *err = (t - *sum) - y;
+    *sum = t;
+}
+
+
+// Apply the rule to steps [first; last) of the grid start + i * step for all
+// nfuncs functions at once, sums[o] gets the sum of output o (nout in total).
+// Points are computed from their index, so the position of the chunk does not
+// matter and no error is accumulated by repeated additions. Base point of
+// every block is computed in KERNEL_WIDE, offsets inside the block are small
+// enough for KERNEL_T. The end correction of closed rules is not applied here
+static void KFN(integrate_chunk)(const struct integrand *const *funcs, int nfuncs, int nout,
+                                 const struct rule *rule, KERNEL_WIDE start, KERNEL_WIDE step,
+                                 long long first, long long last, farg_t *sums)
+{
+    // points are gathered into a block and every function evaluates it by
+    // a single call, while the block is still in L1
+    KERNEL_T xs[BATCH_SIZE], ys[MAX_FUSED * BATCH_SIZE];
+    KERNEL_T kstep = step;
+    KERNEL_T res[MAX_FUSED] = { .0 }, err[MAX_FUSED] = { .0 };
+    for (long long i = first; i < last; i += BATCH_SIZE) {
+        size_t n = (last - i < BATCH_SIZE) ? last - i : BATCH_SIZE;
+
+        // one node at a time keeps the inner loops trivial to vectorize
+        for (int j = 0; j < rule->npoints; j++) {
+            KERNEL_T base = start + ((KERNEL_WIDE)i + rule->nodes[j]) * step;
+            for (size_t k = 0; k < n; k++)
+                xs[k] = base + (KERNEL_T)k * kstep;
+
+            KERNEL_T *out = ys;
+            for (int f = 0; f < nfuncs; out += funcs[f++]->nout * n)
+                KFN(integrand_eval_multi)(funcs[f], xs, out, n);
+
+            KERNEL_T weight = rule->weights[j];
+            for (int o = 0; o < nout; o++)
+                KFN(kahan_add)(&res[o], &err[o], weight * KFN(block_sum)(&ys[o * n], n));
+        }
+    }
+
+    // step is the same for every panel, so multiply once
+    for (int o = 0; o < nout; o++)
+        sums[o] = res[o] * step;
+}
+
+
+#undef KFN
+#undef KCAT
+#undef KCAT_